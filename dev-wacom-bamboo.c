@@ -30,6 +30,7 @@
 
 #include "qemu/osdep.h"
 #include "ui/console.h"
+#include "ui/input.h"
 #include "hw/usb.h"
 #include "migration/vmstate.h"
 #include "qemu/module.h"
@@ -37,6 +38,7 @@
 #include "qom/object.h"
 #include "qemu/timer.h"
 #include "hw/qdev-properties.h"
+#include "dev-wacom-common.h"
 
 /* Interface requests */
 #define WACOM_GET_REPORT	0x01
@@ -68,15 +70,30 @@
 #define TABLET_RESOLUTION_X 14720
 #define TABLET_RESOLUTION_Y 9200
 
+/* Limits of our report format. Report fields are 16 bits wide */
+#define PROTOCOL_MAX_COORDINATE 0xFFFF
+#define PROTOCOL_MAX_PRESSURE 0xFFFF
+
+#define PEN_REPORT_LENGTH 9
+
 #define TABLET_NAME_QEMU "QEMU Bamboo tablet"
 
 typedef struct USBWacomState {
     USBDevice dev;
     USBEndpoint *intr;
-    QEMUPutMouseEntry *eh_entry;
-    USBDesc usb_desc_custom; /* If we customise product/vendor ids */
+    QemuInputHandlerState *ih;
+    WacomModel model;
+    WacomDesc desc;
+    char *model_file;
     int dx, dy, dz, buttons_state;
     int x, y, pressure;
+
+    // Host pointer state, gathered until the input layer syncs
+    int inputX, inputY, inputButtons, inputWheel;
+
+    // The console whose pointer we follow, or NULL to follow whichever has focus
+    char *display;
+    uint32_t head;
     enum {
         WACOM_MODE_HID = 1,
         WACOM_MODE_WACOM = 2,
@@ -89,6 +106,24 @@ typedef struct USBWacomState {
     bool penInProx;
     
     bool changedPen, changedProximity;
+
+    // The pen report as it'll next be sent, re-encoded only when the pen's state changes
+    uint8_t penReport[PEN_REPORT_LENGTH];
+    WacomReportFilter penFilter;
+
+    WacomHidPointer hid;
+
+    char *pressure_curve;
+    WacomMapping mapping;
+
+    char *display_area, *active_area;
+    WacomTransform transform;
+
+    WacomLatencyProbe latency;
+    WacomIngest ingest;
+    WacomFaults faults;
+
+    WacomBringup bringup;
 };
 
 #define TYPE_USB_WACOM "usb-wacom-tablet-bamboo"
@@ -252,7 +287,8 @@ static const USBDescIface wacom_ifaces[] = {
                     0x00,          /*  u8  country_code */
                     0x01,          /*  u8  num_descriptors */
                     USB_DT_REPORT, /*  u8  type: Report */
-                    0xb0, 0,       /*  u16 len */
+                    sizeof(interface_1_hid_report_descriptor) & 0xFF,
+                    sizeof(interface_1_hid_report_descriptor) >> 8, /*  u16 len */
                 },
             },
         },
@@ -282,7 +318,8 @@ static const USBDescIface wacom_ifaces[] = {
                     0x00,          /*  u8  country_code */
                     0x01,          /*  u8  num_descriptors */
                     USB_DT_REPORT, /*  u8  type: Report */
-                    0x4B, 0,       /*  u16 len */
+                    sizeof(interface_2_hid_report_descriptor) & 0xFF,
+                    sizeof(interface_2_hid_report_descriptor) >> 8, /*  u16 len */
                 },
             },
         },
@@ -343,38 +380,27 @@ static const USBDesc desc_wacom_default = {
     .str  = desc_strings,
 };
 
-static inline int int_clamp(int val, int vmin, int vmax)
-{
-    if (val < vmin)
-        return vmin;
-    else if (val > vmax)
-        return vmax;
-    else
-        return val;
-}
-
-static void usb_wacom_event(void *opaque,
-                            int x, int y, int dz, int buttons_state)
-{
-    USBWacomState *s = opaque;
-
-    /* scale to tablet resolution */
-    s->x = (x * TABLET_RESOLUTION_X / 0x7FFF);
-    s->y = (y * TABLET_RESOLUTION_Y / 0x7FFF);
-    s->dz += dz;
-    s->pressure = int_clamp(s->pressure - dz * 32, TABLET_POINTER_DOWN_MIN_PRESSURE, TABLET_MAX_PRESSURE);
-    s->buttons_state = buttons_state;
-    
-    s->changedPen = true;
-    s->lastInputEventTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
-    
-    if (!s->penInProx) {
-        s->penInProx = true;
-        s->changedProximity = true;
-    }
-    
-    usb_wakeup(s->intr, 0);
-}
+/* Our built-in model, IDs and strings come from desc_wacom_default */
+static const WacomModel builtin_model = {
+    .resolutionX = TABLET_RESOLUTION_X,
+    .resolutionY = TABLET_RESOLUTION_Y,
+    .maxPressure = TABLET_MAX_PRESSURE,
+    .numInterfaces = 2,
+    .interfaces = {
+        {
+            .reportDescriptor       = interface_1_hid_report_descriptor,
+            .reportDescriptorLength = sizeof(interface_1_hid_report_descriptor),
+            .maxPacketSize          = 9,
+            .interval               = 4,
+        },
+        {
+            .reportDescriptor       = interface_2_hid_report_descriptor,
+            .reportDescriptorLength = sizeof(interface_2_hid_report_descriptor),
+            .maxPacketSize          = 64,
+            .interval               = 4,
+        },
+    },
+};
 
 #define WACOM_REPORT_PENABLED 2
 #define WACOM_REPORT_INTUOS_PEN 16
@@ -389,8 +415,26 @@ static void usb_wacom_event(void *opaque,
 #define WACOM_BUTTON_2 0x04
 #define WACOM_BUTTON_RUBBER 0x08
 
-static int usb_wacom_poll(USBWacomState *s, uint8_t *buf, int len)
+// Sent on the touch endpoint to show that we're still alive while the pen is out of prox
+static const uint8_t touch_ping_report[WACOM_PKGLEN_BBTOUCH3] = {
+    WACOM_REPORT_PENABLED,
+    0, // Empty touch event
+};
+
+static inline int int_clamp(int val, int vmin, int vmax)
 {
+    if (val < vmin)
+        return vmin;
+    else if (val > vmax)
+        return vmax;
+    else
+        return val;
+}
+
+/* Bring the pen report up to date after the pen's state has changed. The report ID and range byte never change */
+static void usb_wacom_update_pen_report(USBWacomState *s)
+{
+    uint8_t *buf = s->penReport;
     int b;
     uint16_t pressure;
     
@@ -403,10 +447,6 @@ static int usb_wacom_poll(USBWacomState *s, uint8_t *buf, int len)
     if (s->buttons_state & MOUSE_EVENT_RBUTTON)
         b |= WACOM_BUTTON_2;
 
-    if (len < 9)
-        return 0;
-
-    buf[0] = WACOM_REPORT_PENABLED;
     buf[1] = b;
 
     buf[2] = s->x & 0xff;
@@ -415,55 +455,191 @@ static int usb_wacom_poll(USBWacomState *s, uint8_t *buf, int len)
     buf[5] = s->y >> 8;
 
     if (b & (WACOM_BUTTON_PEN | WACOM_BUTTON_RUBBER)) {
-        pressure = s->pressure;
+        pressure = wacom_mapping_pressure(&s->mapping, s->pressure);
     } else {
         pressure = 0;
     }
 
     buf[6] = pressure & 0xff;
     buf[7] = pressure >> 8;
+}
 
-    buf[8] = 0; // Range
+static int usb_wacom_poll(USBWacomState *s, uint8_t *buf, int len)
+{
+    if (len < PEN_REPORT_LENGTH)
+        return 0;
+
+    memcpy(buf, s->penReport, PEN_REPORT_LENGTH);
+
+    return PEN_REPORT_LENGTH;
+}
+
+static void usb_wacom_input_event(DeviceState *dev, QemuConsole *src, InputEvent *evt)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+    InputMoveEvent *move;
+    InputBtnEvent *btn;
+
+    switch (evt->type) {
+        case INPUT_EVENT_KIND_ABS:
+            move = evt->u.abs.data;
+            if (move->axis == INPUT_AXIS_X) {
+                s->inputX = move->value;
+            } else if (move->axis == INPUT_AXIS_Y) {
+                s->inputY = move->value;
+            }
+            break;
+
+        case INPUT_EVENT_KIND_BTN:
+            btn = evt->u.btn.data;
+
+            switch (btn->button) {
+                case INPUT_BUTTON_WHEEL_UP:
+                    if (btn->down)
+                        s->inputWheel++;
+                    break;
+                case INPUT_BUTTON_WHEEL_DOWN:
+                    if (btn->down)
+                        s->inputWheel--;
+                    break;
+                default:
+                    if (btn->down) {
+                        s->inputButtons |= 1 << btn->button;
+                    } else {
+                        s->inputButtons &= ~(1 << btn->button);
+                    }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void usb_wacom_input_sync(DeviceState *dev)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+    int buttons = wacom_hid_pointer_buttons(s->inputButtons);
+    int dz = -s->inputWheel;
+
+    s->inputWheel = 0;
+
+    if (s->mode == WACOM_MODE_HID) {
+        wacom_hid_pointer_event(&s->hid, s->inputX, s->inputY, dz, buttons);
+        usb_wakeup(s->intr, 0);
+        return;
+    }
+
+    /* map the display area onto the tablet's active area */
+    s->x = wacom_transform_axis(&s->transform.x, s->inputX);
+    s->y = wacom_transform_axis(&s->transform.y, s->inputY);
+    wacom_latency_inject(&s->latency, 0, &s->x, &s->y, s->model.resolutionX, s->model.resolutionY);
+    s->dz += dz;
+    s->pressure = int_clamp(s->pressure - dz * 32, TABLET_POINTER_DOWN_MIN_PRESSURE, s->model.maxPressure);
+    s->buttons_state = buttons;
+    
+    s->changedPen = true;
+    s->lastInputEventTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+    
+    if (!s->penInProx) {
+        s->penInProx = true;
+        s->changedProximity = true;
+    }
+
+    usb_wacom_update_pen_report(s);
     
-    return len;
+    usb_wakeup(s->intr, 0);
 }
 
-static int usb_wacom_touch(USBWacomState *s, uint8_t *buf, int len)
+static QemuInputHandler usb_wacom_input_handler = {
+    .name  = TABLET_NAME_QEMU,
+    .mask  = INPUT_EVENT_MASK_BTN | INPUT_EVENT_MASK_ABS,
+    .event = usb_wacom_input_event,
+    .sync  = usb_wacom_input_sync,
+};
+
+static void usb_wacom_apply_sample(USBWacomState *s, const WacomSample *sample)
 {
-    if (len < WACOM_PKGLEN_BBTOUCH3)
-        return 0;
+    s->lastInputEventTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
 
-    buf[0] = WACOM_REPORT_PENABLED;
-    buf[1] = 0; // Empty touch event
+    if (!sample->inProx) {
+        if (s->penInProx) {
+            s->penInProx = false;
+            s->changedProximity = true;
+            usb_wacom_update_pen_report(s);
+        }
+        return;
+    }
 
-    return WACOM_PKGLEN_BBTOUCH3;
+    s->x = wacom_transform_axis(&s->transform.x, sample->x);
+    s->y = wacom_transform_axis(&s->transform.y, sample->y);
+    wacom_latency_inject(&s->latency, sample->time, &s->x, &s->y, s->model.resolutionX, s->model.resolutionY);
+    s->pressure = (int64_t) sample->pressure * s->model.maxPressure / WACOM_SAMPLE_MAX_PRESSURE;
+    s->buttons_state = wacom_hid_pointer_buttons(sample->buttons);
+
+    s->changedPen = true;
+
+    if (!s->penInProx) {
+        s->penInProx = true;
+        s->changedProximity = true;
+    }
+
+    usb_wacom_update_pen_report(s);
+}
+
+/* Bring in what the external input source has sent since the last poll */
+static void usb_wacom_ingest(USBWacomState *s)
+{
+    WacomSample sample;
+
+    if (s->mode == WACOM_MODE_WACOM) {
+        // One sample per report, so that the guest sees every one of them
+        if (!s->changedPen && !s->changedProximity && wacom_ingest_pop(&s->ingest, &sample)) {
+            usb_wacom_apply_sample(s, &sample);
+        }
+    } else {
+        // While we're a HID pointer only the latest position matters
+        while (wacom_ingest_pop(&s->ingest, &sample)) {
+            wacom_hid_pointer_event(&s->hid, sample.x, sample.y, 0, wacom_hid_pointer_buttons(sample.buttons));
+        }
+    }
 }
 
 static void usb_wacom_set_tablet_mode(USBWacomState *s, int mode)
 {
-    if (s->eh_entry) {
-        qemu_remove_mouse_event_handler(s->eh_entry);
+    if (s->ih) {
+        qemu_input_handler_unregister(s->ih);
+        s->ih = NULL;
     }
 
     s->mode = mode;
 
     switch (mode) {
         case WACOM_MODE_WACOM:
-            s->eh_entry = qemu_add_mouse_event_handler(usb_wacom_event, s, 1, TABLET_NAME_QEMU);
+            s->ih = wacom_input_claim((DeviceState *) s, &usb_wacom_input_handler, s->display, s->head);
+            wacom_bringup_wacom_mode(&s->bringup);
             break;
         case WACOM_MODE_HID:
         default:
-            s->eh_entry = 0;
-    }
-
-    if (s->eh_entry) {
-        qemu_activate_mouse_event_handler(s->eh_entry);
+            // We don't take over the host's pointer until a HID driver starts listening to us
+            break;
     }
 
     // Start off with pen out of prox until we get some cursor events
     s->penInProx = false;
     s->changedPen = false;
     s->changedProximity = true;
+
+    usb_wacom_update_pen_report(s);
+    wacom_report_filter_reset(&s->penFilter);
+    s->hid.changed = false;
+}
+
+static void usb_wacom_claim_input(USBWacomState *s)
+{
+    if (!s->ih) {
+        s->ih = wacom_input_claim((DeviceState *) s, &usb_wacom_input_handler, s->display, s->head);
+    }
 }
 
 static void usb_wacom_handle_reset(USBDevice *dev)
@@ -476,7 +652,15 @@ static void usb_wacom_handle_reset(USBDevice *dev)
     s->x = 0;
     s->y = 0;
     s->buttons_state = 0;
+    s->inputX = 0;
+    s->inputY = 0;
+    s->inputButtons = 0;
+    s->inputWheel = 0;
+    wacom_hid_pointer_reset(&s->hid);
+    wacom_faults_reset(&s->faults);
     usb_wacom_set_tablet_mode(s, WACOM_MODE_HID);
+
+    wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_RESET);
 }
 
 static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
@@ -485,6 +669,8 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
     USBWacomState *s = (USBWacomState *) dev;
     int ret;
 
+    wacom_bringup_control(&s->bringup, request, value, index, length);
+
     ret = usb_desc_handle_control(dev, p, request, value, index, length, data);
     if (ret >= 0) {
         return;
@@ -498,10 +684,12 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
                 info_report(TYPE_USB_WACOM ": Set tablet mode %d", data[0]);
 
                 usb_wacom_set_tablet_mode(s, data[0]);
+                wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_MODE);
                 break;
 
             default:
                 warn_report(TYPE_USB_WACOM ": Ignoring unsupported Wacom command %02x", data[0]);
+                wacom_bringup_unsupported(&s->bringup);
         }
         break;
     case ClassInterfaceOutRequest | WACOM_GET_REPORT:
@@ -512,25 +700,24 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
         p->actual_length = 2;
         break;
     case ClassInterfaceOutRequest | HID_SET_PROTOCOL:
-        warn_report(TYPE_USB_WACOM ": Ignoring attempt to switch between boot and report protocols");
+        info_report(TYPE_USB_WACOM ": Set %s protocol", value == 0 ? "boot" : "report");
+
+        s->hid.bootProtocol = value == 0;
+        wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_PROTOCOL);
+        break;
+    case ClassInterfaceRequest | HID_GET_PROTOCOL:
+        data[0] = s->hid.bootProtocol ? 0 : 1;
+        p->actual_length = 1;
         break;
     case InterfaceRequest | USB_REQ_GET_DESCRIPTOR:
         switch (value >> 8) {
             case USB_DT_REPORT:
-                switch (index) {
-                case 0:
-                    memcpy(data, interface_1_hid_report_descriptor,
-                            sizeof(interface_1_hid_report_descriptor));
-                    p->actual_length = sizeof(interface_1_hid_report_descriptor);
-                    break;
-                case 1:
-                    memcpy(data, interface_2_hid_report_descriptor,
-                            sizeof(interface_2_hid_report_descriptor));
-                    p->actual_length = sizeof(interface_2_hid_report_descriptor);
-                    break;
-                default:
+                if (index >= s->model.numInterfaces) {
                     goto fail;
                 }
+
+                p->actual_length = MIN(s->desc.reportDescriptorLengths[index], length);
+                memcpy(data, s->desc.reportDescriptors[index], p->actual_length);
                 break;
             
             default:
@@ -542,7 +729,7 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
 
         switch (value >> 8)  {
             case USB_DT_HID:
-                memcpy(data, desc_device_wacom.confs[0].ifs[(value & 0xFF) >= 1 ? 1 : 0].descs[0].data, 9);
+                memcpy(data, s->desc.hidDescData[(value & 0xFF) >= 1 ? 1 : 0], 9);
                 p->actual_length = 9;
                 break;
 
@@ -571,6 +758,10 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
                 data[1] = s->mode;
                 p->actual_length = 2;
                 break;
+            case WACOM_HID_POINTER_REPORT_ID:
+                if (s->mode == WACOM_MODE_HID && s->hid.enabled)
+                    p->actual_length = wacom_hid_pointer_report(&s->hid, data, length);
+                break;
             default:
                 if (s->mode == WACOM_MODE_WACOM)
                     p->actual_length = usb_wacom_poll(s, data, length);
@@ -584,10 +775,13 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
         break;
     case ClassInterfaceOutRequest | HID_SET_IDLE:
         s->idle = (uint8_t) (value >> 8);
+        wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_IDLE_RATE);
         break;
     default:
         warn_report(TYPE_USB_WACOM ": Rejecting unsupported control request %x value %x index %x", request, value, index);
+        wacom_bringup_unsupported(&s->bringup);
     fail:
+        wacom_bringup_stall(&s->bringup);
         p->status = USB_RET_STALL;
     }
 }
@@ -595,9 +789,8 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
 static void usb_wacom_handle_data(USBDevice *dev, USBPacket *p)
 {
     USBWacomState *s = (USBWacomState *) dev;
-    uint8_t buf[p->iov.size];
-    int len = 0;
     int64_t currentTime;
+    bool keepAlive;
 
     switch (p->pid) {
     case USB_TOKEN_IN:
@@ -613,17 +806,28 @@ static void usb_wacom_handle_data(USBDevice *dev, USBPacket *p)
                 /* When we're idling with no pen in proximity, we have to send SOME packets otherwise the driver
                  * will think we died. So send an empty touch packet:
                  */
-                if (!s->penInProx && !s->changedProximity && currentTime - s->lastPacketTime > PEN_PING_INTERVAL) {
+                if (!s->penInProx && !s->changedProximity && currentTime - s->lastPacketTime > PEN_PING_INTERVAL
+                        && p->iov.size >= sizeof(touch_ping_report)) {
                     s->lastPacketTime = currentTime;
 
-                    len = usb_wacom_touch(s, buf, p->iov.size);
-                    usb_packet_copy(p, buf, len);
+                    usb_packet_copy(p, (uint8_t *) touch_ping_report, sizeof(touch_ping_report));
                 } else {
                     p->status = USB_RET_NAK;
                 }
                 break;
                
             case 1: // Pen endpoint
+                usb_wacom_ingest(s);
+
+                if (s->mode == WACOM_MODE_HID && s->hid.enabled) {
+                    usb_wacom_claim_input(s);
+
+                    if (!wacom_hid_pointer_send(&s->hid, p)) {
+                        p->status = USB_RET_NAK;
+                    }
+                    break;
+                }
+
                 if (s->mode != WACOM_MODE_WACOM) {
                     p->status = USB_RET_NAK;
                     break;
@@ -635,24 +839,49 @@ static void usb_wacom_handle_data(USBDevice *dev, USBPacket *p)
                 if (s->penInProx && !s->changedPen && currentTime - s->lastInputEventTime > PEN_LEAVE_TIMEOUT) {
                     s->penInProx = false;
                     s->changedProximity = true;
+                    usb_wacom_update_pen_report(s);
                 }
                 
                 // Driver assumes pen has left if it doesn't get a ping every 1.5 seconds, so tickle it to keep it alive
-                if (s->penInProx && currentTime - s->lastPacketTime > PEN_PING_INTERVAL) {
-                    s->changedPen = true;
-                }
+                keepAlive = s->penInProx && currentTime - s->lastPacketTime > PEN_PING_INTERVAL;
                 
-                if (!(s->changedPen || s->changedProximity)) {
+                // With nothing new to say, a report the faults held back earlier may have come due
+                if (!(s->changedPen || s->changedProximity || keepAlive)) {
+                    if (!wacom_faults_poll(&s->faults, p, currentTime)) {
+                        p->status = USB_RET_NAK;
+                    }
+                    break;
+                }
+
+                // A packet too small for the report can't carry it, so leave the report for the next one
+                if (p->iov.size < PEN_REPORT_LENGTH) {
                     p->status = USB_RET_NAK;
                     break;
                 }
+
+                // Input that didn't change anything the driver can see isn't worth an interrupt
+                if (!wacom_report_filter_pass(&s->penFilter, s->penReport, PEN_REPORT_LENGTH, keepAlive || s->changedProximity)) {
+                    s->changedPen = false;
+                    wacom_bringup_suppressed(&s->bringup);
+                    if (!wacom_faults_poll(&s->faults, p, currentTime)) {
+                        p->status = USB_RET_NAK;
+                    }
+                    break;
+                }
+
+                if (!wacom_faults_send(&s->faults, p, s->penReport, PEN_REPORT_LENGTH, s->changedProximity, currentTime)) {
+                    p->status = USB_RET_NAK;
+                }
                 
                 s->lastPacketTime = currentTime;
+                wacom_latency_sent(&s->latency);
 
                 s->changedProximity = false;
                 s->changedPen = false;
-                len = usb_wacom_poll(s, buf, p->iov.size);
-                usb_packet_copy(p, buf, len);
+
+                if (s->penInProx) {
+                    wacom_bringup_pen_report(&s->bringup);
+                }
                 break;
             default:
                 goto fail;
@@ -665,41 +894,188 @@ static void usb_wacom_handle_data(USBDevice *dev, USBPacket *p)
     }
 }
 
+static void usb_wacom_handle_attach(USBDevice *dev)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+
+    wacom_bringup_attach(&s->bringup);
+    usb_desc_attach(dev);
+}
+
 static void usb_wacom_unrealize(USBDevice *dev)
 {
     USBWacomState *s = (USBWacomState *) dev;
 
-    if (s->eh_entry) {
-        qemu_remove_mouse_event_handler(s->eh_entry);
-        s->eh_entry = 0;
+    if (s->ih) {
+        qemu_input_handler_unregister(s->ih);
+        s->ih = NULL;
     }
+
+    wacom_ingest_stop(&s->ingest);
+    wacom_faults_stop(&s->faults);
     
     dev->usb_desc = 0;
+    wacom_model_free(&s->model);
+    wacom_mapping_free(&s->mapping);
+    wacom_hid_pointer_free(&s->hid);
+    wacom_latency_close(&s->latency);
+}
+
+static void usb_wacom_init_desc(USBWacomState *s)
+{
+    WacomModel model = s->model;
+
+    if (s->product_id != 0) {
+        model.productId = s->product_id;
+    }
+    if (s->vendor_id != 0) {
+        model.vendorId = s->vendor_id;
+    }
+
+    if (s->hid.enabled) {
+        wacom_hid_pointer_extend(&s->hid, &model.interfaces[0]);
+    }
+
+    wacom_desc_build(&s->desc, &desc_wacom_default, &model);
+
+    s->dev.usb_desc = &s->desc.desc;
+    usb_desc_init(&s->dev);
+}
+
+/* Load and check a model, but leave it to the caller to start using it */
+static bool usb_wacom_load_model(const char *filename, WacomModel *model, Error **errp)
+{
+    if (filename) {
+        if (!wacom_model_load(model, filename, &builtin_model, errp)) {
+            return false;
+        }
+    } else {
+        wacom_model_copy(model, &builtin_model);
+    }
+
+    if (model->resolutionX > PROTOCOL_MAX_COORDINATE || model->resolutionY > PROTOCOL_MAX_COORDINATE ||
+            model->maxPressure > PROTOCOL_MAX_PRESSURE) {
+        error_setg(errp, TYPE_USB_WACOM ": Model's resolution or pressure range is too large for our reports");
+        wacom_model_free(model);
+        return false;
+    }
+
+    if (model->interfaces[0].maxPacketSize < PEN_REPORT_LENGTH ||
+            model->interfaces[1].maxPacketSize < WACOM_PKGLEN_BBTOUCH3) {
+        error_setg(errp, TYPE_USB_WACOM ": Endpoints are too small for our reports");
+        wacom_model_free(model);
+        return false;
+    }
+
+    return true;
+}
+
+static void usb_wacom_swap(USBDevice *dev, WacomTabletSwap *args, Error **errp)
+{
+    USBWacomState *s = USB_WACOM(dev);
+    bool attached = dev->attached;
+    const char *model_file = args->has_model_file ? args->model_file : NULL;
+    WacomModel model;
+    WacomTransform transform;
+
+    // Load the new model first so that we stay as we are if it's no good
+    if (!usb_wacom_load_model(model_file, &model, errp)) {
+        return;
+    }
+
+    // The active area and pressure curve are sampled at the new model's resolution
+    if (!wacom_transform_build(&transform, &model, s->display_area, s->active_area, errp) ||
+            !wacom_mapping_build(&s->mapping, &model, s->pressure_curve, NULL, NULL, errp)) {
+        wacom_model_free(&model);
+        return;
+    }
+
+    // The guest sees this as an unplug followed by a replug of a different tablet
+    if (attached) {
+        usb_device_detach(dev);
+    }
+
+    wacom_model_free(&s->model);
+    s->model = model;
+    s->transform = transform;
+    s->pressure = int_clamp(s->pressure, TABLET_POINTER_DOWN_MIN_PRESSURE, s->model.maxPressure);
+    usb_wacom_update_pen_report(s);
+
+    g_free(s->model_file);
+    s->model_file = g_strdup(model_file);
+    s->vendor_id = args->has_vendorid ? args->vendorid : 0;
+    s->product_id = args->has_productid ? args->productid : 0;
+    usb_wacom_init_desc(s);
+
+    info_report(TYPE_USB_WACOM ": Swapped to %s, vendor %04x product %04x",
+        model_file ? model_file : "built-in model", s->desc.desc.id.idVendor, s->desc.desc.id.idProduct);
+
+    if (attached) {
+        usb_device_attach(dev, errp);
+    }
+}
+
+static void usb_wacom_query(USBDevice *dev, WacomTabletInfo *info)
+{
+    USBWacomState *s = USB_WACOM(dev);
+
+    info->mode = s->mode == WACOM_MODE_WACOM ? WACOM_TABLET_MODE_WACOM : WACOM_TABLET_MODE_HID;
+    info->boot_protocol = s->hid.bootProtocol;
+    info->idle_rate = s->idle;
 }
 
 static void usb_wacom_realize(USBDevice *dev, Error **errp)
 {
     USBWacomState *s = USB_WACOM(dev);
-    
-    if (s->product_id != 0 || s->vendor_id != 0) {
-        // Make a copy of the USB descriptor so we can customise the product ID
-        memcpy((char*) &s->usb_desc_custom, (char*) &desc_wacom_default, sizeof(desc_wacom_default));
-        
-        s->usb_desc_custom.id.idProduct = s->product_id;
-        s->usb_desc_custom.id.idVendor = s->vendor_id;
-        
-        dev->usb_desc = &s->usb_desc_custom;
-    } else {
-        dev->usb_desc = &desc_wacom_default;
+
+    if (!wacom_input_check_display(s->display, s->head, errp)) {
+        return;
     }
-    
-    usb_desc_init(dev);
+
+    if (!usb_wacom_load_model(s->model_file, &s->model, errp)) {
+        return;
+    }
+
+    if (!wacom_transform_build(&s->transform, &s->model, s->display_area, s->active_area, errp) ||
+            !wacom_mapping_build(&s->mapping, &s->model, s->pressure_curve, NULL, NULL, errp)) {
+        wacom_model_free(&s->model);
+        return;
+    }
+
+    if (!wacom_latency_open(&s->latency, errp)) {
+        wacom_model_free(&s->model);
+        wacom_mapping_free(&s->mapping);
+        return;
+    }
+
+    s->pressure = int_clamp(TABLET_CLICK_PRESSURE, TABLET_POINTER_DOWN_MIN_PRESSURE, s->model.maxPressure);
+
     s->intr = usb_ep_get(dev, USB_TOKEN_IN, 1);
-    s->eh_entry = 0;
-    s->pressure = TABLET_CLICK_PRESSURE;
+
+    // These can still fail, so they come before the descriptors that would need freeing
+    if (!wacom_faults_init(&s->faults, s->intr, TYPE_USB_WACOM, errp)) {
+        wacom_latency_close(&s->latency);
+        wacom_mapping_free(&s->mapping);
+        wacom_model_free(&s->model);
+        return;
+    }
+
+    if (!wacom_ingest_start(&s->ingest, s->intr, TYPE_USB_WACOM, errp)) {
+        wacom_faults_stop(&s->faults);
+        wacom_latency_close(&s->latency);
+        wacom_mapping_free(&s->mapping);
+        wacom_model_free(&s->model);
+        return;
+    }
+
+    usb_wacom_init_desc(s);
+    s->ih = NULL;
     s->lastPacketTime = 0;
     s->lastInputEventTime = 0;
-    
+    s->penReport[0] = WACOM_REPORT_PENABLED;
+    s->penReport[8] = 0; // Range
+    wacom_bringup_init(&s->bringup, TYPE_USB_WACOM);
+
     usb_wacom_set_tablet_mode(s, WACOM_MODE_HID);
 }
 
@@ -711,6 +1087,21 @@ static const VMStateDescription vmstate_usb_wacom = {
 static Property bamboo_properties[] = {
     DEFINE_PROP_UINT16("productid", struct USBWacomState, product_id, 0),
     DEFINE_PROP_UINT16("vendorid", struct USBWacomState, vendor_id, 0),
+    DEFINE_PROP_STRING("model-file", struct USBWacomState, model_file),
+    DEFINE_PROP_BOOL("hid-pointer", struct USBWacomState, hid.enabled, true),
+    DEFINE_PROP_STRING("pressure-curve", struct USBWacomState, pressure_curve),
+    DEFINE_PROP_STRING("display-area", struct USBWacomState, display_area),
+    DEFINE_PROP_STRING("active-area", struct USBWacomState, active_area),
+    DEFINE_PROP_STRING("display", struct USBWacomState, display),
+    DEFINE_PROP_STRING("latency-log", struct USBWacomState, latency.logFile),
+    DEFINE_PROP_STRING("evdev", struct USBWacomState, ingest.path),
+    DEFINE_PROP_UINT32("head", struct USBWacomState, head, 0),
+    DEFINE_PROP_BOOL("bringup-profile", struct USBWacomState, bringup.profile, false),
+    DEFINE_PROP_UINT64("fault-seed", struct USBWacomState, faults.seed, 1),
+    DEFINE_PROP_UINT8("fault-drop", struct USBWacomState, faults.drop, 0),
+    DEFINE_PROP_UINT32("fault-delay", struct USBWacomState, faults.delay, 0),
+    DEFINE_PROP_UINT8("fault-burst", struct USBWacomState, faults.burst, 0),
+    DEFINE_PROP_UINT8("fault-reorder", struct USBWacomState, faults.reorder, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -718,6 +1109,7 @@ static void usb_wacom_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     USBDeviceClass *uc = USB_DEVICE_CLASS(klass);
+    WacomTabletClass *wc = WACOM_TABLET_CLASS(klass);
 
     uc->product_desc   = TABLET_NAME_QEMU;
     uc->usb_desc       = &desc_wacom_default;
@@ -726,13 +1118,17 @@ static void usb_wacom_class_init(ObjectClass *klass, void *data)
     uc->handle_control = usb_wacom_handle_control;
     uc->handle_data    = usb_wacom_handle_data;
     uc->unrealize      = usb_wacom_unrealize;
-    uc->handle_attach  = usb_desc_attach;
+    uc->handle_attach  = usb_wacom_handle_attach;
 
     set_bit(DEVICE_CATEGORY_INPUT, dc->categories);
     dc->desc = TABLET_NAME_QEMU;
     dc->vmsd = &vmstate_usb_wacom;
 
+    wc->swap = usb_wacom_swap;
+    wc->query = usb_wacom_query;
+
     device_class_set_props(dc, bamboo_properties);
+    wacom_bringup_class_init(klass, offsetof(USBWacomState, bringup));
 }
 
 static const TypeInfo wacom_info = {
@@ -740,6 +1136,10 @@ static const TypeInfo wacom_info = {
     .parent        = TYPE_USB_DEVICE,
     .instance_size = sizeof(USBWacomState),
     .class_init    = usb_wacom_class_init,
+    .interfaces    = (InterfaceInfo[]) {
+        { TYPE_WACOM_TABLET },
+        { }
+    },
 };
 
 static void usb_wacom_register_types(void)
@@ -749,3 +1149,8 @@ static void usb_wacom_register_types(void)
 }
 
 type_init(usb_wacom_register_types)
+
+// Newer QEMUs use this to find which module to load for our device type
+#ifdef module_obj
+module_obj(TYPE_USB_WACOM);
+#endif
@@ -0,0 +1,1402 @@
+/*
+ * Shared helpers for the emulated Wacom tablets.
+ *
+ * Copyright (c) 2020 Nicholas Sherlock <n.sherlock@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/timer.h"
+#include "qemu/cutils.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "hw/usb.h"
+#include "sysemu/replay.h"
+#include "ui/console.h"
+#include "ui/input.h"
+#include "dev-wacom-common.h"
+
+#ifdef CONFIG_LINUX
+#include <poll.h>
+#include <linux/input.h>
+
+// Kernel headers before 4.16 only have the timeval
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+#endif
+
+/* Microseconds from attach until the given milestone, or -1 if we haven't got there yet */
+static int64_t wacom_bringup_elapsed_us(WacomBringup *b, int64_t when)
+{
+    if (!b->attachTime || !when) {
+        return -1;
+    }
+
+    return (when - b->attachTime) / SCALE_US;
+}
+
+static void wacom_bringup_get_stats(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    WacomBringup *b = (WacomBringup *) ((char *) obj + (uintptr_t) opaque);
+    int64_t wacomMode = wacom_bringup_elapsed_us(b, b->wacomModeTime);
+    int64_t firstPen = wacom_bringup_elapsed_us(b, b->firstPenTime);
+
+    if (!visit_start_struct(v, name, NULL, 0, errp)) {
+        return;
+    }
+
+    if (visit_type_int(v, "attach-to-wacom-mode-us", &wacomMode, errp) &&
+        visit_type_int(v, "attach-to-first-pen-us", &firstPen, errp) &&
+        visit_type_uint32(v, "control-requests", &b->controlRequests, errp) &&
+        visit_type_uint32(v, "stalled-requests", &b->stalledRequests, errp) &&
+        visit_type_uint32(v, "unsupported-requests", &b->unsupportedRequests, errp) &&
+        visit_type_uint32(v, "suppressed-reports", &b->suppressedReports, errp)) {
+        visit_check_struct(v, errp);
+    }
+
+    visit_end_struct(v, NULL);
+}
+
+void wacom_bringup_class_init(ObjectClass *klass, size_t offset)
+{
+    object_class_property_add(klass, "bringup-stats", "WacomBringupStats",
+                              wacom_bringup_get_stats, NULL, NULL, (void *) (uintptr_t) offset);
+}
+
+void wacom_bringup_init(WacomBringup *b, const char *name)
+{
+    b->name = name;
+}
+
+void wacom_bringup_attach(WacomBringup *b)
+{
+    b->attachTime = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    b->wacomModeTime = 0;
+    b->firstPenTime = 0;
+    b->controlRequests = 0;
+    b->stalledRequests = 0;
+    b->unsupportedRequests = 0;
+    b->suppressedReports = 0;
+
+    if (b->profile) {
+        info_report("%s: Attached", b->name);
+    }
+}
+
+void wacom_bringup_control(WacomBringup *b, int request, int value, int index, int length)
+{
+    b->controlRequests++;
+
+    if (b->profile) {
+        info_report("%s: +%" PRId64 "us control request %04x value %04x index %04x length %d",
+                    b->name, wacom_bringup_elapsed_us(b, qemu_clock_get_ns(QEMU_CLOCK_REALTIME)),
+                    request, value, index, length);
+    }
+}
+
+void wacom_bringup_wacom_mode(WacomBringup *b)
+{
+    if (b->wacomModeTime) {
+        return;
+    }
+
+    b->wacomModeTime = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (b->profile) {
+        info_report("%s: +%" PRId64 "us entered Wacom mode", b->name,
+                    wacom_bringup_elapsed_us(b, b->wacomModeTime));
+    }
+}
+
+void wacom_bringup_pen_report(WacomBringup *b)
+{
+    if (b->firstPenTime || !b->wacomModeTime) {
+        return;
+    }
+
+    b->firstPenTime = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (b->profile) {
+        info_report("%s: +%" PRId64 "us first pen report, %u control requests, %u stalled, %u unsupported",
+                    b->name, wacom_bringup_elapsed_us(b, b->firstPenTime),
+                    b->controlRequests, b->stalledRequests, b->unsupportedRequests);
+    }
+}
+
+/* Check up front that the console we're to be bound to exists, since binding happens later when we take input */
+bool wacom_input_check_display(const char *display, uint32_t head, Error **errp)
+{
+    return !display || qemu_console_lookup_by_device_name(display, head, errp) != NULL;
+}
+
+/* Start listening to the host's input, just to our own console's if we have one */
+QemuInputHandlerState *wacom_input_claim(DeviceState *dev, QemuInputHandler *handler,
+                                         const char *display, uint32_t head)
+{
+    QemuInputHandlerState *ih = qemu_input_handler_register(dev, handler);
+
+    if (display) {
+        qemu_input_handler_bind(ih, display, head, NULL);
+    }
+    qemu_input_handler_activate(ih);
+
+    return ih;
+}
+
+/*
+ * Copy a report straight from where it's kept into the packet, unless it's a repeat of the last one sent on the same
+ * stream and we haven't been told to force it out (e.g. as a keep-alive). Returns false if nothing was sent.
+ */
+bool wacom_report_filter_pass(WacomReportFilter *f, const uint8_t *report, int len, bool force)
+{
+    assert(len <= WACOM_MAX_REPORT_LENGTH);
+
+    if (!force && len == f->lastLength && memcmp(f->last, report, len) == 0) {
+        return false;
+    }
+
+    memcpy(f->last, report, len);
+    f->lastLength = len;
+
+    return true;
+}
+
+bool wacom_report_send(WacomReportFilter *f, USBPacket *p, const uint8_t *report, int len, bool force)
+{
+    if (len > p->iov.size || !wacom_report_filter_pass(f, report, len, force)) {
+        return false;
+    }
+
+    usb_packet_copy(p, (uint8_t *) report, len);
+
+    return true;
+}
+
+/* Parse a mapping's colon-separated points, returns the number of points or 0 on failure */
+static int wacom_mapping_parse(const char *spec, int *points, int min, int max, const char *prop, Error **errp)
+{
+    char **fields = g_strsplit(spec, ":", -1);
+    int count = g_strv_length(fields);
+    int i;
+
+    if (count < 2 || count > WACOM_MAPPING_MAX_POINTS) {
+        error_setg(errp, "%s needs between 2 and %d points", prop, WACOM_MAPPING_MAX_POINTS);
+        count = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (qemu_strtoi(fields[i], NULL, 10, &points[i]) != 0 || points[i] < min || points[i] > max) {
+            error_setg(errp, "%s point '%s' must be a number between %d and %d", prop, fields[i], min, max);
+            count = 0;
+        }
+    }
+
+    g_strfreev(fields);
+
+    return count;
+}
+
+/* Value at entry i of an n-entry table of the line through the points, scaled by outMax / pointMax and rounded */
+static int wacom_mapping_sample(const int *points, int count, int i, int n, int outMax, int pointMax)
+{
+    int64_t pos = (int64_t) i * (count - 1);
+    int seg = pos / (n - 1);
+    int64_t frac = pos % (n - 1);
+    int64_t divisor = (int64_t) pointMax * (n - 1);
+    int64_t v;
+
+    if (seg >= count - 1) {
+        seg = count - 2;
+        frac = n - 1;
+    }
+
+    v = ((int64_t) points[seg] * (n - 1) + (points[seg + 1] - points[seg]) * frac) * outMax;
+
+    return (v >= 0 ? v + divisor / 2 : v - divisor / 2) / divisor;
+}
+
+static bool wacom_mapping_build_tilt(uint8_t *table, const char *spec, const char *prop, Error **errp)
+{
+    int points[WACOM_MAPPING_MAX_POINTS];
+    int count;
+
+    if (!spec) {
+        memset(table, WACOM_TILT_CENTER, WACOM_TILT_STEPS);
+        return true;
+    }
+
+    count = wacom_mapping_parse(spec, points, -WACOM_TILT_CENTER, WACOM_TILT_CENTER - 1, prop, errp);
+    if (!count) {
+        return false;
+    }
+
+    for (int i = 0; i < WACOM_TILT_STEPS; i++) {
+        table[i] = WACOM_TILT_CENTER + wacom_mapping_sample(points, count, i, WACOM_TILT_STEPS, 1, 1);
+    }
+
+    return true;
+}
+
+/* Compile the mappings for the model, leaving m untouched on failure */
+bool wacom_mapping_build(WacomMapping *m, const WacomModel *model, const char *pressureCurve,
+                         const char *tiltX, const char *tiltY, Error **errp)
+{
+    WacomMapping result;
+    int points[WACOM_MAPPING_MAX_POINTS];
+    int count;
+
+    if (pressureCurve) {
+        count = wacom_mapping_parse(pressureCurve, points, 0, 100, "pressure-curve", errp);
+        if (!count) {
+            return false;
+        }
+    } else {
+        points[0] = 0;
+        points[1] = 100;
+        count = 2;
+    }
+
+    if (!wacom_mapping_build_tilt(result.tiltX, tiltX, "tilt-x", errp) ||
+            !wacom_mapping_build_tilt(result.tiltY, tiltY, "tilt-y", errp)) {
+        return false;
+    }
+
+    result.pressure = g_new(uint16_t, model->maxPressure + 1);
+    for (int i = 0; i <= model->maxPressure; i++) {
+        result.pressure[i] = wacom_mapping_sample(points, count, i, model->maxPressure + 1, model->maxPressure, 100);
+    }
+
+    // Coordinates run from 0 to the resolution inclusive, so the far edge lands on the last entry
+    result.tiltScaleX = ((uint64_t) WACOM_TILT_STEPS << 32) / (model->resolutionX + 1);
+    result.tiltScaleY = ((uint64_t) WACOM_TILT_STEPS << 32) / (model->resolutionY + 1);
+
+    wacom_mapping_free(m);
+    *m = result;
+
+    return true;
+}
+
+void wacom_mapping_free(WacomMapping *m)
+{
+    g_free(m->pressure);
+    m->pressure = NULL;
+}
+
+/* Parse an "x:y:width:height" rectangle */
+static bool wacom_transform_parse_area(const char *spec, double *area, const char *prop, Error **errp)
+{
+    char **fields = g_strsplit(spec, ":", -1);
+    bool ok = g_strv_length(fields) == 4;
+
+    for (int i = 0; ok && i < 4; i++) {
+        ok = qemu_strtod(fields[i], NULL, &area[i]) == 0 && area[i] >= 0;
+    }
+
+    g_strfreev(fields);
+
+    if (!ok) {
+        error_setg(errp, "%s must be given as x:y:width:height", prop);
+    }
+
+    return ok;
+}
+
+static void wacom_transform_build_axis(WacomTransformAxis *a, double displayStart, double displaySize,
+                                       int activeStart, int activeSize)
+{
+    int64_t inputStart = displayStart * INPUT_EVENT_ABS_MAX / 100;
+    int64_t inputSize = MAX(displaySize * INPUT_EVENT_ABS_MAX / 100, 1);
+
+    // Round the scale up so that the far edge of the display reaches the far edge of the active area
+    a->scale = (((int64_t) activeSize << 32) + inputSize - 1) / inputSize;
+    a->offset = ((int64_t) activeStart << 32) - inputStart * a->scale;
+    a->min = activeStart;
+    a->max = activeStart + activeSize;
+}
+
+/* Precompute the transform for the model, leaving t untouched on failure */
+bool wacom_transform_build(WacomTransform *t, const WacomModel *model, const char *displayArea,
+                           const char *activeArea, Error **errp)
+{
+    double display[4] = { 0, 0, 100, 100 };
+    double active[4] = { 0, 0, model->resolutionX, model->resolutionY };
+
+    if (displayArea) {
+        if (!wacom_transform_parse_area(displayArea, display, "display-area", errp)) {
+            return false;
+        }
+        // Much smaller than this and a single input unit would jump across the whole active area
+        if (display[2] < 1 || display[3] < 1 || display[0] + display[2] > 100 || display[1] + display[3] > 100) {
+            error_setg(errp, "display-area must be at least 1%% wide and high, and lie within the display");
+            return false;
+        }
+    }
+
+    if (activeArea) {
+        if (!wacom_transform_parse_area(activeArea, active, "active-area", errp)) {
+            return false;
+        }
+        if (active[0] + active[2] > model->resolutionX || active[1] + active[3] > model->resolutionY) {
+            error_setg(errp, "active-area must lie within the tablet's %dx%d resolution",
+                       model->resolutionX, model->resolutionY);
+            return false;
+        }
+    }
+
+    wacom_transform_build_axis(&t->x, display[0], display[2], active[0], active[2]);
+    wacom_transform_build_axis(&t->y, display[1], display[3], active[1], active[3]);
+
+    return true;
+}
+
+bool wacom_latency_open(WacomLatencyProbe *l, Error **errp)
+{
+    if (!l->logFile) {
+        return true;
+    }
+
+    l->log = fopen(l->logFile, "w");
+    if (!l->log) {
+        error_setg_errno(errp, errno, "Can't open latency log '%s'", l->logFile);
+        return false;
+    }
+
+    l->seq = 0;
+    l->sentSeq = 0;
+    fprintf(l->log, "# event sequence host-clock-ns\n");
+
+    return true;
+}
+
+void wacom_latency_close(WacomLatencyProbe *l)
+{
+    if (l->log) {
+        fclose(l->log);
+        l->log = NULL;
+    }
+}
+
+/* Replace the low bits of a coordinate, keeping it within the tablet */
+static int wacom_latency_embed(int value, int bits, int max)
+{
+    value = (value & ~WACOM_LATENCY_SEQ_MASK) | bits;
+
+    return value > max ? value - (WACOM_LATENCY_SEQ_MASK + 1) : value;
+}
+
+/*
+ * Number a new sample of the host's pointer, and stamp the number into its coordinates. when is the QEMU_CLOCK_HOST
+ * time the sample was taken, or 0 for now.
+ */
+void wacom_latency_inject(WacomLatencyProbe *l, int64_t when, int *x, int *y, int maxX, int maxY)
+{
+    if (!l->log) {
+        return;
+    }
+
+    l->seq++;
+    fprintf(l->log, "inject %u %" PRId64 "\n", l->seq, when ? when : qemu_clock_get_ns(QEMU_CLOCK_HOST));
+
+    *x = wacom_latency_embed(*x, l->seq & WACOM_LATENCY_SEQ_MASK, maxX);
+    *y = wacom_latency_embed(*y, (l->seq >> WACOM_LATENCY_SEQ_BITS) & WACOM_LATENCY_SEQ_MASK, maxY);
+}
+
+/* The latest sample has just gone out to the guest. Samples that never do were overtaken between polls */
+void wacom_latency_sent(WacomLatencyProbe *l)
+{
+    if (!l->log || l->sentSeq == l->seq) {
+        return;
+    }
+
+    l->sentSeq = l->seq;
+    fprintf(l->log, "sent %u %" PRId64 "\n", l->seq, qemu_clock_get_ns(QEMU_CLOCK_HOST));
+}
+
+/* Take the next sample from the ingestion thread, returns false if there isn't one yet */
+bool wacom_ingest_pop(WacomIngest *in, WacomSample *sample)
+{
+    unsigned int tail = in->tail;
+
+    if (!in->path) {
+        return false;
+    }
+
+    if (qatomic_load_acquire(&in->head) == tail) {
+        // Have the thread wake us for the next one, then check again in case it arrived in the meantime
+        qatomic_set(&in->waiting, true);
+        smp_mb();
+        if (qatomic_load_acquire(&in->head) == tail) {
+            return false;
+        }
+    }
+
+    *sample = in->queue[tail % WACOM_INGEST_QUEUE_LENGTH];
+    qatomic_store_release(&in->tail, tail + 1);
+
+    return true;
+}
+
+#ifdef CONFIG_LINUX
+
+static void wacom_ingest_push(WacomIngest *in, const WacomSample *sample)
+{
+    unsigned int head = in->head;
+
+    if (head - qatomic_load_acquire(&in->tail) >= WACOM_INGEST_QUEUE_LENGTH) {
+        qatomic_inc(&in->dropped);
+        return;
+    }
+
+    in->queue[head % WACOM_INGEST_QUEUE_LENGTH] = *sample;
+    qatomic_store_release(&in->head, head + 1);
+
+    if (qatomic_xchg(&in->waiting, false)) {
+        qemu_bh_schedule(in->wakeBh);
+    }
+}
+
+static void wacom_ingest_wake(void *opaque)
+{
+    WacomIngest *in = opaque;
+
+    usb_wakeup(in->ep, 0);
+}
+
+static int wacom_ingest_scale(int value, int min, int range, int max)
+{
+    int64_t result = (int64_t) (value - min) * max / range;
+
+    return result < 0 ? 0 : result > max ? max : result;
+}
+
+static void wacom_ingest_decode(WacomIngest *in, const struct input_event *ev)
+{
+    WacomSample *p = &in->pending;
+
+    switch (ev->type) {
+        case EV_ABS:
+            switch (ev->code) {
+                case ABS_X:
+                    p->x = wacom_ingest_scale(ev->value, in->minX, in->rangeX, INPUT_EVENT_ABS_MAX);
+                    break;
+                case ABS_Y:
+                    p->y = wacom_ingest_scale(ev->value, in->minY, in->rangeY, INPUT_EVENT_ABS_MAX);
+                    break;
+                case ABS_PRESSURE:
+                    p->pressure = wacom_ingest_scale(ev->value, in->minPressure, in->rangePressure,
+                                                     WACOM_SAMPLE_MAX_PRESSURE);
+                    break;
+                case ABS_DISTANCE:
+                    p->distance = wacom_ingest_scale(ev->value, in->minDistance, in->rangeDistance,
+                                                     WACOM_SAMPLE_MAX_DISTANCE);
+                    break;
+            }
+            break;
+
+        case EV_KEY:
+            switch (ev->code) {
+                case BTN_TOOL_PEN:
+                case BTN_TOOL_RUBBER:
+                    p->inProx = ev->value != 0;
+                    p->eraser = ev->code == BTN_TOOL_RUBBER && p->inProx;
+                    break;
+                case BTN_TOUCH:
+                    p->buttons = (p->buttons & ~(1 << INPUT_BUTTON_LEFT)) | (!!ev->value << INPUT_BUTTON_LEFT);
+                    break;
+                case BTN_STYLUS:
+                    p->buttons = (p->buttons & ~(1 << INPUT_BUTTON_RIGHT)) | (!!ev->value << INPUT_BUTTON_RIGHT);
+                    break;
+                case BTN_STYLUS2:
+                    p->buttons = (p->buttons & ~(1 << INPUT_BUTTON_MIDDLE)) | (!!ev->value << INPUT_BUTTON_MIDDLE);
+                    break;
+            }
+            break;
+
+        case EV_SYN:
+            if (ev->code == SYN_REPORT) {
+                p->time = (int64_t) ev->input_event_sec * NANOSECONDS_PER_SECOND + ev->input_event_usec * SCALE_US;
+                wacom_ingest_push(in, p);
+            }
+            break;
+    }
+}
+
+static void *wacom_ingest_thread(void *opaque)
+{
+    WacomIngest *in = opaque;
+    struct input_event events[64];
+    struct pollfd fds[2] = {
+        { .fd = in->fd, .events = POLLIN },
+        { .fd = in->stopPipe[0], .events = POLLIN },
+    };
+    ssize_t len;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[1].revents) {
+            break;
+        }
+
+        len = read(in->fd, events, sizeof(events));
+        if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (len <= 0) {
+            warn_report("wacom-ingest: stopped reading %s: %s", in->path, len < 0 ? strerror(errno) : "EOF");
+            break;
+        }
+
+        for (int i = 0; i < len / sizeof(events[0]); i++) {
+            wacom_ingest_decode(in, &events[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/* The range of one of the source's axes, 0 to 1 (and false) if it doesn't have it */
+static bool wacom_ingest_get_axis(int fd, int axis, int *min, int *range)
+{
+    struct input_absinfo info;
+
+    if (ioctl(fd, EVIOCGABS(axis), &info) < 0 || info.maximum <= info.minimum) {
+        *min = 0;
+        *range = 1;
+        return false;
+    }
+
+    *min = info.minimum;
+    *range = info.maximum - info.minimum;
+
+    return true;
+}
+
+bool wacom_ingest_start(WacomIngest *in, USBEndpoint *ep, const char *name, Error **errp)
+{
+    int clock = CLOCK_REALTIME;
+
+    if (!in->path) {
+        return true;
+    }
+
+    // The events would reach the guest without passing through the input layer, so they'd never be recorded
+    if (replay_mode != REPLAY_MODE_NONE) {
+        error_setg(errp, "%s: evdev input can't be used with record/replay", name);
+        return false;
+    }
+
+    in->fd = qemu_open_old(in->path, O_RDONLY | O_NONBLOCK);
+    if (in->fd < 0) {
+        error_setg_errno(errp, errno, "%s: can't open %s", name, in->path);
+        return false;
+    }
+
+    // Take the tablet away from the host, and timestamp its events with the clock we log latencies with
+    if (ioctl(in->fd, EVIOCGRAB, 1) < 0 || ioctl(in->fd, EVIOCSCLOCKID, &clock) < 0) {
+        error_setg_errno(errp, errno, "%s: can't grab %s", name, in->path);
+        qemu_close(in->fd);
+        return false;
+    }
+
+    if (qemu_pipe(in->stopPipe) < 0) {
+        error_setg_errno(errp, errno, "%s: can't create pipe", name);
+        qemu_close(in->fd);
+        return false;
+    }
+
+    wacom_ingest_get_axis(in->fd, ABS_X, &in->minX, &in->rangeX);
+    wacom_ingest_get_axis(in->fd, ABS_Y, &in->minY, &in->rangeY);
+    wacom_ingest_get_axis(in->fd, ABS_PRESSURE, &in->minPressure, &in->rangePressure);
+
+    in->ep = ep;
+    in->head = 0;
+    in->tail = 0;
+    in->waiting = false;
+    in->dropped = 0;
+    in->wakeBh = qemu_bh_new(wacom_ingest_wake, in);
+    memset(&in->pending, 0, sizeof(in->pending));
+
+    // Tablets that don't report the pen's height leave it to the device to pick one
+    if (!wacom_ingest_get_axis(in->fd, ABS_DISTANCE, &in->minDistance, &in->rangeDistance)) {
+        in->pending.distance = -1;
+    }
+
+    qemu_thread_create(&in->thread, "wacom-ingest", wacom_ingest_thread, in, QEMU_THREAD_JOINABLE);
+
+    return true;
+}
+
+void wacom_ingest_stop(WacomIngest *in)
+{
+    char stop = 0;
+
+    if (!in->path || !in->ep) {
+        return;
+    }
+
+    if (write(in->stopPipe[1], &stop, 1) != 1) {
+        warn_report("wacom-ingest: can't stop reading %s", in->path);
+        return;
+    }
+    qemu_thread_join(&in->thread);
+    qemu_bh_delete(in->wakeBh);
+
+    close(in->stopPipe[0]);
+    close(in->stopPipe[1]);
+    qemu_close(in->fd);
+    in->ep = NULL;
+
+    if (in->dropped) {
+        warn_report("wacom-ingest: dropped %u samples from %s that arrived while the tablet's queue was full",
+                    in->dropped, in->path);
+    }
+}
+
+#else
+
+bool wacom_ingest_start(WacomIngest *in, USBEndpoint *ep, const char *name, Error **errp)
+{
+    if (in->path) {
+        error_setg(errp, "%s: evdev input is only supported on Linux hosts", name);
+        return false;
+    }
+
+    return true;
+}
+
+void wacom_ingest_stop(WacomIngest *in)
+{
+}
+
+#endif
+
+static void wacom_faults_timer(void *opaque)
+{
+    WacomFaults *f = opaque;
+
+    usb_wakeup(f->ep, 0);
+}
+
+bool wacom_faults_init(WacomFaults *f, USBEndpoint *ep, const char *name, Error **errp)
+{
+    if (f->drop > 100 || f->burst > 100 || f->reorder > 100) {
+        error_setg(errp, "%s: fault-drop, fault-burst and fault-reorder are percentages, so can't be more than 100",
+                   name);
+        return false;
+    }
+
+    if (f->burst && !f->delay) {
+        error_setg(errp, "%s: fault-burst needs a fault-delay to stall the reports for", name);
+        return false;
+    }
+
+    f->enabled = f->drop || f->delay || f->reorder;
+
+    if (f->enabled) {
+        info_report("%s: Injecting faults with seed %" PRIu64 ": %d%% dropped, delayed up to %u ms, "
+                    "%d%% stalled, %d%% of proximity changes reordered",
+                    name, f->seed, f->drop, f->delay, f->burst, f->reorder);
+    }
+
+    f->name = name;
+    f->ep = ep;
+    wacom_faults_reset(f);
+
+    if (f->enabled) {
+        f->timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, wacom_faults_timer, f);
+    }
+
+    return true;
+}
+
+void wacom_faults_stop(WacomFaults *f)
+{
+    if (f->timer) {
+        timer_free(f->timer);
+        f->timer = NULL;
+    }
+}
+
+/* Start over from the seed, so that every run from reset sees the same faults */
+void wacom_faults_reset(WacomFaults *f)
+{
+    if (f->dropped || f->reordered || f->overflowed || f->oversized) {
+        info_report("%s: Faults since the last reset: %u reports dropped, %u reordered, %u lost to a full queue, "
+                    "%u too big for the packet", f->name, f->dropped, f->reordered, f->overflowed, f->oversized);
+    }
+
+    // Nothing is held any more, so there's nothing for the endpoint to be woken for
+    if (f->timer) {
+        timer_del(f->timer);
+    }
+
+    f->dropped = 0;
+    f->reordered = 0;
+    f->overflowed = 0;
+    f->oversized = 0;
+
+    // Xorshift gets stuck at zero
+    f->state = f->seed ? f->seed : 1;
+    f->stallUntil = 0;
+    f->head = 0;
+    f->count = 0;
+}
+
+static uint64_t wacom_faults_random(WacomFaults *f)
+{
+    f->state ^= f->state << 13;
+    f->state ^= f->state >> 7;
+    f->state ^= f->state << 17;
+
+    return f->state;
+}
+
+static bool wacom_faults_roll(WacomFaults *f, int percent)
+{
+    return percent && wacom_faults_random(f) % 100 < percent;
+}
+
+static void wacom_faults_push(WacomFaults *f, const uint8_t *report, int len, bool prox, int64_t now)
+{
+    WacomFaultReport *r, *last;
+
+    assert(len <= WACOM_FAULT_REPORT_MAX);
+
+    if (wacom_faults_roll(f, f->burst)) {
+        f->stallUntil = now + f->delay;
+    }
+
+    if (wacom_faults_roll(f, f->drop)) {
+        f->dropped++;
+        return;
+    }
+
+    if (f->count == WACOM_FAULT_QUEUE_LENGTH) {
+        f->overflowed++;
+        return;
+    }
+
+    r = &f->queue[(f->head + f->count) % WACOM_FAULT_QUEUE_LENGTH];
+    memcpy(r->data, report, len);
+    r->len = len;
+    r->due = now + (f->delay ? wacom_faults_random(f) % (f->delay + 1) : 0);
+    r->swap = prox && wacom_faults_roll(f, f->reorder);
+
+    if (f->count > 0) {
+        last = &f->queue[(f->head + f->count - 1) % WACOM_FAULT_QUEUE_LENGTH];
+
+        // The proximity report waiting at the tail is overtaken by this one
+        if (last->swap) {
+            WacomFaultReport held = *last;
+
+            *last = *r;
+            *r = held;
+            r->swap = false;
+            r->due = MAX(r->due, last->due);
+            f->reordered++;
+        }
+    }
+
+    f->count++;
+}
+
+bool wacom_faults_apply(WacomFaults *f, USBPacket *p, const uint8_t *report, int len, bool prox, int64_t now)
+{
+    WacomFaultReport *r;
+    int64_t due;
+
+    if (report) {
+        wacom_faults_push(f, report, len, prox, now);
+    }
+
+    // A report too big for the packet would never go out and would hold back everything behind it
+    while (f->count > 0 && f->queue[f->head].len > p->iov.size) {
+        f->head = (f->head + 1) % WACOM_FAULT_QUEUE_LENGTH;
+        f->count--;
+        f->oversized++;
+    }
+
+    if (f->count == 0) {
+        return false;
+    }
+
+    r = &f->queue[f->head];
+    due = MAX(f->stallUntil, r->swap ? r->due + WACOM_FAULT_REORDER_WAIT : r->due);
+
+    // Reports leave in order, so a late one holds back everything behind it, which then goes out back-to-back
+    if (now < due) {
+        timer_mod(f->timer, due);
+        return false;
+    }
+
+    usb_packet_copy(p, r->data, r->len);
+
+    f->head = (f->head + 1) % WACOM_FAULT_QUEUE_LENGTH;
+    f->count--;
+
+    return true;
+}
+
+/* Largest report descriptor we'll accept from a model file */
+#define WACOM_MODEL_MAX_REPORT_DESCRIPTOR 4096
+
+/* Largest packet a full-speed interrupt endpoint can carry */
+#define WACOM_MODEL_MAX_PACKET_SIZE 64
+
+void wacom_model_copy(WacomModel *dst, const WacomModel *src)
+{
+    int i;
+
+    *dst = *src;
+
+    dst->manufacturer = g_strdup(src->manufacturer);
+    dst->product = g_strdup(src->product);
+    dst->serial = g_strdup(src->serial);
+
+    for (i = 0; i < src->numInterfaces; i++) {
+        uint8_t *reportDescriptor = g_malloc(src->interfaces[i].reportDescriptorLength);
+
+        memcpy(reportDescriptor, src->interfaces[i].reportDescriptor, src->interfaces[i].reportDescriptorLength);
+        dst->interfaces[i].reportDescriptor = reportDescriptor;
+    }
+}
+
+void wacom_model_free(WacomModel *m)
+{
+    int i;
+
+    g_free((char *) m->manufacturer);
+    g_free((char *) m->product);
+    g_free((char *) m->serial);
+
+    for (i = 0; i < m->numInterfaces; i++) {
+        g_free((uint8_t *) m->interfaces[i].reportDescriptor);
+    }
+
+    memset(m, 0, sizeof(*m));
+}
+
+/* Split on whitespace, dropping the empty fields between repeated separators */
+static char **wacom_model_split(const char *value, int *count)
+{
+    char **fields = g_strsplit_set(value, " \t", -1);
+    int i, j;
+
+    for (i = 0, j = 0; fields[i]; i++) {
+        if (fields[i][0]) {
+            fields[j++] = fields[i];
+        } else {
+            g_free(fields[i]);
+        }
+    }
+    fields[j] = NULL;
+
+    *count = j;
+    return fields;
+}
+
+static bool wacom_model_parse_uint(const char *str, int base, unsigned int max, unsigned int *result)
+{
+    return qemu_strtoui(str, NULL, base, result) == 0 && *result <= max;
+}
+
+static bool wacom_model_parse_uints(const char *value, int base, unsigned int max,
+                                    unsigned int *results, int count)
+{
+    int n, i;
+    char **fields = wacom_model_split(value, &n);
+    bool ok = n == count;
+
+    for (i = 0; ok && i < count; i++) {
+        ok = wacom_model_parse_uint(fields[i], base, max, &results[i]);
+    }
+
+    g_strfreev(fields);
+    return ok;
+}
+
+/* Walk the descriptor's HID items, so that one which claims more data than is left is caught before the guest sees it */
+static bool wacom_model_check_report_descriptor(const uint8_t *desc, unsigned int length, Error **errp)
+{
+    static const unsigned int shortItemSizes[] = { 0, 1, 2, 4 };
+    unsigned int pos = 0, size;
+
+    while (pos < length) {
+        if (desc[pos] == 0xFE) {
+            // Long item: prefix, data size, tag, data
+            if (length - pos < 3) {
+                error_setg(errp, "Report descriptor's long item at byte %u is cut off", pos);
+                return false;
+            }
+            size = 3 + desc[pos + 1];
+        } else {
+            size = 1 + shortItemSizes[desc[pos] & 0x03];
+        }
+
+        if (size > length - pos) {
+            error_setg(errp, "Report descriptor's item at byte %u runs past its end", pos);
+            return false;
+        }
+
+        pos += size;
+    }
+
+    return true;
+}
+
+/* hid-recorder "R: <length> <hex bytes...>" report descriptor line */
+static bool wacom_model_parse_report_descriptor(WacomModelInterface *iface, const char *value, Error **errp)
+{
+    int n, i;
+    char **fields = wacom_model_split(value, &n);
+    unsigned int length, byte;
+    uint8_t *reportDescriptor = NULL;
+    bool ok = n >= 1 && wacom_model_parse_uint(fields[0], 10, UINT_MAX, &length);
+
+    if (!ok) {
+        error_setg(errp, "Report descriptor must start with its length");
+    } else if (length == 0 || length > WACOM_MODEL_MAX_REPORT_DESCRIPTOR) {
+        error_setg(errp, "Report descriptor must be 1 to %d bytes long", WACOM_MODEL_MAX_REPORT_DESCRIPTOR);
+        ok = false;
+    } else if (length != n - 1) {
+        error_setg(errp, "Report descriptor is %u bytes long but has %d bytes", length, n - 1);
+        ok = false;
+    }
+
+    if (ok) {
+        reportDescriptor = g_malloc(length);
+
+        for (i = 0; ok && i < length; i++) {
+            ok = wacom_model_parse_uint(fields[i + 1], 16, 0xFF, &byte);
+            reportDescriptor[i] = byte;
+        }
+
+        if (!ok) {
+            error_setg(errp, "Report descriptor byte %d isn't a hex byte", i);
+        }
+    }
+
+    ok = ok && wacom_model_check_report_descriptor(reportDescriptor, length, errp);
+
+    if (ok) {
+        g_free((uint8_t *) iface->reportDescriptor);
+        iface->reportDescriptor = reportDescriptor;
+        iface->reportDescriptorLength = length;
+    } else {
+        g_free(reportDescriptor);
+    }
+
+    g_strfreev(fields);
+    return ok;
+}
+
+static bool wacom_model_parse_line(WacomModel *m, const char *key, const char *value,
+                                   int *reportDescriptors, bool *haveProduct, Error **errp)
+{
+    unsigned int v[3];
+
+    if (!strcmp(key, "R")) {
+        if (*reportDescriptors >= m->numInterfaces) {
+            error_setg(errp, "More report descriptors than the tablet's %d interfaces", m->numInterfaces);
+            return false;
+        }
+        return wacom_model_parse_report_descriptor(&m->interfaces[(*reportDescriptors)++], value, errp);
+    } else if (!strcmp(key, "I")) {
+        // "I: <bus> <vendor> <product>", all hex
+        if (!wacom_model_parse_uints(value, 16, 0xFFFF, v, 3)) {
+            goto invalid;
+        }
+        m->vendorId = v[1];
+        m->productId = v[2];
+    } else if (!strcmp(key, "N")) {
+        if (!*haveProduct) {
+            g_free((char *) m->product);
+            m->product = g_strdup(value);
+        }
+    } else if (strlen(key) == 1) {
+        // Other hid-recorder lines (physical path, recorded events) don't describe the model
+    } else if (!strcmp(key, "manufacturer")) {
+        g_free((char *) m->manufacturer);
+        m->manufacturer = g_strdup(value);
+    } else if (!strcmp(key, "product")) {
+        g_free((char *) m->product);
+        m->product = g_strdup(value);
+        *haveProduct = true;
+    } else if (!strcmp(key, "serial")) {
+        g_free((char *) m->serial);
+        m->serial = g_strdup(value);
+    } else if (!strcmp(key, "vendor-id")) {
+        if (!wacom_model_parse_uints(value, 0, 0xFFFF, v, 1)) {
+            goto invalid;
+        }
+        m->vendorId = v[0];
+    } else if (!strcmp(key, "product-id")) {
+        if (!wacom_model_parse_uints(value, 0, 0xFFFF, v, 1)) {
+            goto invalid;
+        }
+        m->productId = v[0];
+    } else if (!strcmp(key, "bcd-device")) {
+        if (!wacom_model_parse_uints(value, 0, 0xFFFF, v, 1)) {
+            goto invalid;
+        }
+        m->bcdDevice = v[0];
+    } else if (!strcmp(key, "resolution")) {
+        if (!wacom_model_parse_uints(value, 0, INT_MAX, v, 2) || v[0] == 0 || v[1] == 0) {
+            goto invalid;
+        }
+        m->resolutionX = v[0];
+        m->resolutionY = v[1];
+    } else if (!strcmp(key, "pressure")) {
+        if (!wacom_model_parse_uints(value, 0, INT_MAX, v, 1) || v[0] == 0) {
+            goto invalid;
+        }
+        m->maxPressure = v[0];
+    } else if (!strcmp(key, "interface")) {
+        // "interface: <number> <max packet size> <interval>"
+        if (!wacom_model_parse_uints(value, 0, 0xFFFF, v, 3) || v[0] >= m->numInterfaces
+                || v[2] == 0 || v[2] > 0xFF) {
+            goto invalid;
+        }
+        if (v[1] == 0 || v[1] > WACOM_MODEL_MAX_PACKET_SIZE) {
+            error_setg(errp, "Interrupt endpoint's max packet size must be 1 to %d bytes",
+                       WACOM_MODEL_MAX_PACKET_SIZE);
+            return false;
+        }
+        m->interfaces[v[0]].maxPacketSize = v[1];
+        m->interfaces[v[0]].interval = v[2];
+    } else {
+        goto invalid;
+    }
+
+    return true;
+
+invalid:
+    error_setg(errp, "Invalid model file line");
+    return false;
+}
+
+/*
+ * Load a model file. Anything the file doesn't set is taken from @defaults,
+ * which also fixes the number of interfaces the model must describe.
+ *
+ * The format is line based, "key: value", with '#' comments. The "R:", "I:"
+ * and "N:" lines of hid-recorder dumps (as found in the linuxwacom
+ * wacom-hid-descriptors repository) can be pasted in directly, with one "R:"
+ * report descriptor line per interface in interface order.
+ */
+bool wacom_model_load(WacomModel *m, const char *filename, const WacomModel *defaults, Error **errp)
+{
+    g_autofree char *contents = NULL;
+    GError *err = NULL;
+    char **lines;
+    int lineNo, reportDescriptors = 0;
+    bool haveProduct = false, ok = true;
+
+    if (!g_file_get_contents(filename, &contents, NULL, &err)) {
+        error_setg(errp, "Failed to read Wacom model file: %s", err->message);
+        g_error_free(err);
+        return false;
+    }
+
+    wacom_model_copy(m, defaults);
+
+    lines = g_strsplit(contents, "\n", -1);
+
+    for (lineNo = 0; ok && lines[lineNo]; lineNo++) {
+        char *line = g_strstrip(lines[lineNo]);
+        char *value = strchr(line, ':');
+
+        if (!line[0] || line[0] == '#') {
+            continue;
+        }
+
+        if (value) {
+            *value++ = '\0';
+            value = g_strstrip(value);
+        }
+
+        if (!value) {
+            error_setg(errp, "%s:%d: Invalid model file line", filename, lineNo + 1);
+            ok = false;
+        } else if (!wacom_model_parse_line(m, g_strstrip(line), value, &reportDescriptors, &haveProduct, errp)) {
+            error_prepend(errp, "%s:%d: ", filename, lineNo + 1);
+            ok = false;
+        }
+    }
+
+    g_strfreev(lines);
+
+    if (ok && reportDescriptors != 0 && reportDescriptors != m->numInterfaces) {
+        error_setg(errp, "%s: Model has %d report descriptors but the tablet has %d interfaces",
+                   filename, reportDescriptors, m->numInterfaces);
+        ok = false;
+    }
+
+    if (!ok) {
+        wacom_model_free(m);
+    }
+
+    return ok;
+}
+
+void wacom_desc_build(WacomDesc *d, const USBDesc *tmpl, const WacomModel *m)
+{
+    const USBDescConfig *config = &tmpl->full->confs[0];
+    int i;
+
+    assert(config->nif == m->numInterfaces);
+
+    d->config = *config;
+    d->config.ifs = d->ifaces;
+
+    for (i = 0; i < config->nif; i++) {
+        const USBDescIface *iface = &config->ifs[i];
+        const WacomModelInterface *mi = &m->interfaces[i];
+
+        assert(iface->ndesc == 1 && iface->bNumEndpoints == 1);
+
+        // Our HID class descriptor always matches the length of the report descriptor we serve
+        memcpy(d->hidDescData[i], iface->descs[0].data, sizeof(d->hidDescData[i]));
+        d->hidDescData[i][7] = mi->reportDescriptorLength & 0xFF;
+        d->hidDescData[i][8] = mi->reportDescriptorLength >> 8;
+
+        d->reportDescriptors[i] = mi->reportDescriptor;
+        d->reportDescriptorLengths[i] = mi->reportDescriptorLength;
+
+        d->hidDescs[i] = iface->descs[0];
+        d->hidDescs[i].data = d->hidDescData[i];
+
+        d->eps[i] = iface->eps[0];
+        d->eps[i].wMaxPacketSize = mi->maxPacketSize;
+        d->eps[i].bInterval = mi->interval;
+
+        d->ifaces[i] = *iface;
+        d->ifaces[i].descs = &d->hidDescs[i];
+        d->ifaces[i].eps = &d->eps[i];
+    }
+
+    d->desc = *tmpl;
+
+    d->full = *tmpl->full;
+    d->full.confs = &d->config;
+    d->desc.full = &d->full;
+
+    if (tmpl->high) {
+        d->high = *tmpl->high;
+        d->high.confs = &d->config;
+        d->desc.high = &d->high;
+    }
+
+    if (m->vendorId) {
+        d->desc.id.idVendor = m->vendorId;
+    }
+    if (m->productId) {
+        d->desc.id.idProduct = m->productId;
+    }
+    if (m->bcdDevice) {
+        d->desc.id.bcdDevice = m->bcdDevice;
+    }
+
+    memcpy(d->strings, tmpl->str, sizeof(d->strings));
+
+    if (m->manufacturer && tmpl->id.iManufacturer) {
+        d->strings[tmpl->id.iManufacturer] = m->manufacturer;
+    }
+    if (m->product && tmpl->id.iProduct) {
+        d->strings[tmpl->id.iProduct] = m->product;
+    }
+    if (m->serial && tmpl->id.iSerialNumber) {
+        d->strings[tmpl->id.iSerialNumber] = m->serial;
+    }
+
+    d->desc.str = d->strings;
+}
+
+static const uint8_t wacom_hid_pointer_report_descriptor[] = {
+    0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
+    0x09, 0x02,        // Usage (Mouse)
+    0xA1, 0x01,        // Collection (Application)
+    0x85, WACOM_HID_POINTER_REPORT_ID, // Report ID
+    0x09, 0x01,        //   Usage (Pointer)
+    0xA1, 0x00,        //   Collection (Physical)
+    0x05, 0x09,        //     Usage Page (Button)
+    0x19, 0x01,        //     Usage Minimum (0x01)
+    0x29, 0x03,        //     Usage Maximum (0x03)
+    0x15, 0x00,        //     Logical Minimum (0)
+    0x25, 0x01,        //     Logical Maximum (1)
+    0x95, 0x03,        //     Report Count (3)
+    0x75, 0x01,        //     Report Size (1)
+    0x81, 0x02,        //     Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
+    0x95, 0x01,        //     Report Count (1)
+    0x75, 0x05,        //     Report Size (5)
+    0x81, 0x01,        //     Input (Const,Array,Abs,No Wrap,Linear,Preferred State,No Null Position)
+    0x05, 0x01,        //     Usage Page (Generic Desktop Ctrls)
+    0x09, 0x30,        //     Usage (X)
+    0x09, 0x31,        //     Usage (Y)
+    0x15, 0x00,        //     Logical Minimum (0)
+    0x26, 0xFF, 0x7F,  //     Logical Maximum (32767)
+    0x35, 0x00,        //     Physical Minimum (0)
+    0x46, 0xFF, 0x7F,  //     Physical Maximum (32767)
+    0x65, 0x00,        //     Unit (None)
+    0x55, 0x00,        //     Unit Exponent (0)
+    0x75, 0x10,        //     Report Size (16)
+    0x95, 0x02,        //     Report Count (2)
+    0x81, 0x02,        //     Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
+    0x09, 0x38,        //     Usage (Wheel)
+    0x15, 0x81,        //     Logical Minimum (-127)
+    0x25, 0x7F,        //     Logical Maximum (127)
+    0x35, 0x00,        //     Physical Minimum (0)
+    0x45, 0x00,        //     Physical Maximum (0)
+    0x75, 0x08,        //     Report Size (8)
+    0x95, 0x01,        //     Report Count (1)
+    0x81, 0x06,        //     Input (Data,Var,Rel,No Wrap,Linear,Preferred State,No Null Position)
+    0xC0,              //   End Collection
+    0xC0,              // End Collection
+};
+
+/* Boot protocol reports are relative, this many input units make up one count */
+#define WACOM_HID_BOOT_SCALE 16
+
+/* Point the interface at a copy of its report descriptor that has our pointer's collection on the end */
+void wacom_hid_pointer_extend(WacomHidPointer *h, WacomModelInterface *iface)
+{
+    size_t length = iface->reportDescriptorLength + sizeof(wacom_hid_pointer_report_descriptor);
+
+    g_free(h->reportDescriptor);
+    h->reportDescriptor = g_malloc(length);
+
+    memcpy(h->reportDescriptor, iface->reportDescriptor, iface->reportDescriptorLength);
+    memcpy(h->reportDescriptor + iface->reportDescriptorLength, wacom_hid_pointer_report_descriptor,
+           sizeof(wacom_hid_pointer_report_descriptor));
+
+    iface->reportDescriptor = h->reportDescriptor;
+    iface->reportDescriptorLength = length;
+}
+
+void wacom_hid_pointer_free(WacomHidPointer *h)
+{
+    g_free(h->reportDescriptor);
+    h->reportDescriptor = NULL;
+}
+
+void wacom_hid_pointer_reset(WacomHidPointer *h)
+{
+    // USB devices come out of reset speaking the report protocol
+    h->bootProtocol = false;
+    h->changed = false;
+    h->dz = 0;
+    h->bootX = h->x;
+    h->bootY = h->y;
+}
+
+void wacom_hid_pointer_event(WacomHidPointer *h, int x, int y, int dz, int buttons)
+{
+    h->x = x;
+    h->y = y;
+    h->dz += dz;
+    h->buttons = buttons;
+    h->changed = true;
+}
+
+int wacom_hid_pointer_report(WacomHidPointer *h, uint8_t *buf, int len)
+{
+    int b = 0, dx, dy, wheel;
+
+    if (h->buttons & MOUSE_EVENT_LBUTTON)
+        b |= 0x01;
+    if (h->buttons & MOUSE_EVENT_RBUTTON)
+        b |= 0x02;
+    if (h->buttons & MOUSE_EVENT_MBUTTON)
+        b |= 0x04;
+
+    if (h->bootProtocol) {
+        if (len < WACOM_HID_BOOT_REPORT_LENGTH)
+            return 0;
+
+        dx = MAX(MIN((h->x - h->bootX) / WACOM_HID_BOOT_SCALE, 127), -127);
+        dy = MAX(MIN((h->y - h->bootY) / WACOM_HID_BOOT_SCALE, 127), -127);
+
+        h->bootX += dx * WACOM_HID_BOOT_SCALE;
+        h->bootY += dy * WACOM_HID_BOOT_SCALE;
+        h->dz = 0; // Boot mice have no wheel
+
+        // Long moves take a few reports to play out
+        h->changed = dx != 0 || dy != 0;
+
+        buf[0] = b;
+        buf[1] = dx;
+        buf[2] = dy;
+
+        return WACOM_HID_BOOT_REPORT_LENGTH;
+    }
+
+    if (len < WACOM_HID_POINTER_REPORT_LENGTH)
+        return 0;
+
+    wheel = MAX(MIN(-h->dz, 127), -127);
+    h->dz += wheel;
+    h->changed = h->dz != 0;
+
+    // Keep the boot protocol's idea of the pointer in step, in case the guest switches over
+    h->bootX = h->x;
+    h->bootY = h->y;
+
+    buf[0] = WACOM_HID_POINTER_REPORT_ID;
+    buf[1] = b;
+    buf[2] = h->x & 0xFF;
+    buf[3] = h->x >> 8;
+    buf[4] = h->y & 0xFF;
+    buf[5] = h->y >> 8;
+    buf[6] = wheel;
+
+    return WACOM_HID_POINTER_REPORT_LENGTH;
+}
+
+/* Send the pointer's state if it has changed since the last report, returns false if there was nothing to send */
+bool wacom_hid_pointer_send(WacomHidPointer *h, USBPacket *p)
+{
+    uint8_t buf[WACOM_HID_POINTER_REPORT_LENGTH];
+    int len;
+
+    if (!h->changed) {
+        return false;
+    }
+
+    len = wacom_hid_pointer_report(h, buf, MIN(p->iov.size, sizeof(buf)));
+    if (len == 0) {
+        return false;
+    }
+
+    usb_packet_copy(p, buf, len);
+
+    return true;
+}
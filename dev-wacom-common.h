@@ -0,0 +1,412 @@
+/*
+ * Shared helpers for the emulated Wacom tablets.
+ *
+ * Copyright (c) 2020 Nicholas Sherlock <n.sherlock@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef HW_USB_DEV_WACOM_COMMON_H
+#define HW_USB_DEV_WACOM_COMMON_H
+
+#include "hw/usb.h"
+#include "ui/console.h"
+#include "ui/input.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qapi/qapi-types-wacom.h"
+#include "desc.h"
+
+#define WACOM_MAX_INTERFACES 3
+
+/*
+ * Interface implemented by each of the emulated tablets, so that the QMP
+ * commands in dev-wacom-qmp.c can find them and drive them.
+ */
+#define TYPE_WACOM_TABLET "wacom-tablet"
+
+typedef struct WacomTabletClass {
+    InterfaceClass parent_class;
+
+    /* Rebuild our descriptors with a new identity, replugging if attached */
+    void (*swap)(USBDevice *dev, WacomTabletSwap *args, Error **errp);
+
+    /* Change the tool in one of the tablet's tool slots, NULL if the tablet only has the one pen */
+    void (*set_tool)(USBDevice *dev, WacomTabletSetTool *args, Error **errp);
+
+    /* Change the state of the tablet's Express Keys and Touch Ring, NULL if it has none */
+    void (*set_pad)(USBDevice *dev, WacomTabletSetPad *args, Error **errp);
+
+    /* Change the state of the tablet's radio link to its wireless receiver, NULL if it can't be used wirelessly */
+    void (*set_link)(USBDevice *dev, WacomTabletSetLink *args, Error **errp);
+
+    /* Fill in the state the guest has put the tablet into, the common fields are already filled */
+    void (*query)(USBDevice *dev, WacomTabletInfo *info);
+} WacomTabletClass;
+
+DECLARE_CLASS_CHECKERS(WacomTabletClass, WACOM_TABLET, TYPE_WACOM_TABLET)
+
+/* Tell QMP clients that the guest has changed the tablet's state, e.g. switched it into Wacom mode */
+void wacom_tablet_state_changed(USBDevice *dev, WacomTabletStateChange change);
+
+/*
+ * The parts of a tablet that vary between models of the same protocol family,
+ * either one of the built-in models or loaded from a model file. IDs and
+ * strings left as 0/NULL are taken from the protocol's template descriptor.
+ */
+typedef struct WacomModelInterface {
+    const uint8_t *reportDescriptor;
+    uint16_t reportDescriptorLength;
+    uint16_t maxPacketSize;
+    uint8_t interval;
+} WacomModelInterface;
+
+typedef struct WacomModel {
+    uint16_t vendorId, productId, bcdDevice;
+    const char *manufacturer, *product, *serial;
+
+    int resolutionX, resolutionY;
+    int maxPressure;
+
+    int numInterfaces;
+    WacomModelInterface interfaces[WACOM_MAX_INTERFACES];
+} WacomModel;
+
+/*
+ * USB descriptors built from a protocol's template descriptor and a model.
+ * Every interface of the template must have exactly one endpoint and a HID
+ * class descriptor.
+ */
+typedef struct WacomDesc {
+    USBDesc desc;
+    USBDescDevice full, high;
+    USBDescConfig config;
+    USBDescIface ifaces[WACOM_MAX_INTERFACES];
+    USBDescOther hidDescs[WACOM_MAX_INTERFACES];
+    uint8_t hidDescData[WACOM_MAX_INTERFACES][9];
+    USBDescEndpoint eps[WACOM_MAX_INTERFACES];
+    USBDescStrings strings;
+
+    // The report descriptors to serve, which may differ from the model's if we've added to them
+    const uint8_t *reportDescriptors[WACOM_MAX_INTERFACES];
+    uint16_t reportDescriptorLengths[WACOM_MAX_INTERFACES];
+} WacomDesc;
+
+/*
+ * Tablets bound to a console with their "display" and "head" properties only receive that console's input, so that
+ * several tablets can each follow their own console at once. Unbound tablets follow whichever console has focus.
+ */
+bool wacom_input_check_display(const char *display, uint32_t head, Error **errp);
+QemuInputHandlerState *wacom_input_claim(DeviceState *dev, QemuInputHandler *handler,
+                                         const char *display, uint32_t head);
+
+/*
+ * Absolute pointer offered on interface 0 while the tablet is in HID mode, so that guests without a Wacom driver
+ * (installers, login screens, firmware) can still use the tablet. Its collection is appended to the model's own
+ * interface 0 report descriptor. Guests that switch to the boot protocol get relative boot mouse reports instead.
+ */
+#define WACOM_HID_POINTER_REPORT_ID 0x0F
+#define WACOM_HID_POINTER_REPORT_LENGTH 7
+#define WACOM_HID_BOOT_REPORT_LENGTH 3
+
+typedef struct WacomHidPointer {
+    bool enabled;
+    bool bootProtocol;
+    bool changed;
+
+    int x, y, dz, buttons; // In input layer units, buttons are MOUSE_EVENT_* bits
+    int bootX, bootY;      // Where a boot protocol guest thinks the pointer is
+
+    uint8_t *reportDescriptor;
+} WacomHidPointer;
+
+static inline int wacom_hid_pointer_buttons(int inputButtons)
+{
+    return (inputButtons & (1 << INPUT_BUTTON_LEFT) ? MOUSE_EVENT_LBUTTON : 0)
+        | (inputButtons & (1 << INPUT_BUTTON_RIGHT) ? MOUSE_EVENT_RBUTTON : 0)
+        | (inputButtons & (1 << INPUT_BUTTON_MIDDLE) ? MOUSE_EVENT_MBUTTON : 0);
+}
+
+void wacom_hid_pointer_extend(WacomHidPointer *h, WacomModelInterface *iface);
+void wacom_hid_pointer_free(WacomHidPointer *h);
+void wacom_hid_pointer_reset(WacomHidPointer *h);
+void wacom_hid_pointer_event(WacomHidPointer *h, int x, int y, int dz, int buttons);
+int wacom_hid_pointer_report(WacomHidPointer *h, uint8_t *buf, int len);
+bool wacom_hid_pointer_send(WacomHidPointer *h, USBPacket *p);
+
+/* Longest interrupt report that we keep a copy of for duplicate suppression */
+#define WACOM_MAX_REPORT_LENGTH 16
+
+/*
+ * Remembers the last report sent on a report stream, so that a byte-identical repeat of it can be dropped instead
+ * of costing the guest an interrupt.
+ */
+typedef struct WacomReportFilter {
+    uint8_t last[WACOM_MAX_REPORT_LENGTH];
+    int lastLength;
+} WacomReportFilter;
+
+bool wacom_report_send(WacomReportFilter *f, USBPacket *p, const uint8_t *report, int len, bool force);
+
+/* As wacom_report_send, for reports that are held back before they're sent. True if the report should go out */
+bool wacom_report_filter_pass(WacomReportFilter *f, const uint8_t *report, int len, bool force);
+
+/* Let the next report through whatever it is, e.g. after the driver has reinitialised the tablet */
+static inline void wacom_report_filter_reset(WacomReportFilter *f)
+{
+    f->lastLength = 0;
+}
+
+/*
+ * Mapping from the pen's state as we track it to what the tablet reports. The pressure curve and tilt mappings are
+ * colon-separated lists of points spread evenly across their input range, joined by straight lines: pressures are
+ * percentages of the model's maximum pressure, and tilts are degrees (-64 to 63) at evenly spaced positions across
+ * the tablet. They're compiled into lookup tables for the model when the tablet is realized, so mapping a sample
+ * costs a single table lookup.
+ */
+#define WACOM_MAPPING_MAX_POINTS 64
+#define WACOM_TILT_STEPS 256
+#define WACOM_TILT_CENTER 64
+
+typedef struct WacomMapping {
+    uint16_t *pressure;   // maxPressure + 1 entries
+    uint8_t tiltX[WACOM_TILT_STEPS], tiltY[WACOM_TILT_STEPS]; // As reported, WACOM_TILT_CENTER is upright
+    uint64_t tiltScaleX, tiltScaleY; // Scale a coordinate to a tilt table index, in 32.32 fixed point
+} WacomMapping;
+
+bool wacom_mapping_build(WacomMapping *m, const WacomModel *model, const char *pressureCurve,
+                         const char *tiltX, const char *tiltY, Error **errp);
+void wacom_mapping_free(WacomMapping *m);
+
+static inline int wacom_mapping_pressure(const WacomMapping *m, int pressure)
+{
+    return m->pressure[pressure];
+}
+
+static inline uint8_t wacom_mapping_tilt_x(const WacomMapping *m, int x)
+{
+    return m->tiltX[(x * m->tiltScaleX) >> 32];
+}
+
+static inline uint8_t wacom_mapping_tilt_y(const WacomMapping *m, int y)
+{
+    return m->tiltY[(y * m->tiltScaleY) >> 32];
+}
+
+/*
+ * Transform from the input layer's absolute coordinates to tablet coordinates. The display area (a rectangle of the
+ * display, in percent) is mapped onto the tablet's active area (a rectangle of the tablet, in tablet counts), and
+ * pointer positions outside the display area are pinned to the edge of the active area. Each axis is precomputed as
+ * a 32.32 fixed point scale and offset, so transforming a sample costs one multiply-shift per axis.
+ */
+typedef struct WacomTransformAxis {
+    int64_t scale, offset;
+    int min, max;
+} WacomTransformAxis;
+
+typedef struct WacomTransform {
+    WacomTransformAxis x, y;
+} WacomTransform;
+
+bool wacom_transform_build(WacomTransform *t, const WacomModel *model, const char *displayArea,
+                           const char *activeArea, Error **errp);
+
+static inline int wacom_transform_axis(const WacomTransformAxis *a, int value)
+{
+    int64_t result = (value * a->scale + a->offset) >> 32;
+
+    return result < a->min ? a->min : result > a->max ? a->max : result;
+}
+
+/*
+ * End-to-end latency probe. Each sample of the host's pointer gets the next sequence number, which replaces the low
+ * bits of the reported coordinates (X carries its low bits and Y its high bits), and the times that each sample was
+ * injected and that the report carrying it was handed to the guest are logged. Joined up with what a reader in the
+ * guest saw (tools/wacom-latency-reader.c), this measures the whole path from the host's input to the guest's.
+ */
+#define WACOM_LATENCY_SEQ_BITS 6
+#define WACOM_LATENCY_SEQ_MASK ((1 << WACOM_LATENCY_SEQ_BITS) - 1)
+
+typedef struct WacomLatencyProbe {
+    char *logFile; // Probe is off if NULL
+    FILE *log;
+    uint32_t seq;     // The latest sample's sequence number
+    uint32_t sentSeq; // The last sequence number handed to the guest
+} WacomLatencyProbe;
+
+bool wacom_latency_open(WacomLatencyProbe *l, Error **errp);
+void wacom_latency_close(WacomLatencyProbe *l);
+void wacom_latency_inject(WacomLatencyProbe *l, int64_t when, int *x, int *y, int maxX, int maxY);
+void wacom_latency_sent(WacomLatencyProbe *l);
+
+/*
+ * Input from an external source, such as a real tablet's evdev device on the host, which is read and decoded on a
+ * thread of its own instead of in the main loop. Decoded samples are passed to the device through a lock-free queue
+ * with a single producer (the ingestion thread) and a single consumer (the device, under the BQL). The thread only
+ * schedules a bottom half, which wakes the endpoint from the main loop, when the device has found the queue empty.
+ * It never takes the BQL, so stopping it can wait for it to finish while holding the BQL.
+ */
+#define WACOM_INGEST_QUEUE_LENGTH 256 // Must be a power of two
+#define WACOM_SAMPLE_MAX_PRESSURE 0xFFFF
+#define WACOM_SAMPLE_MAX_DISTANCE 0xFFFF
+
+typedef struct WacomSample {
+    int64_t time;  // QEMU_CLOCK_HOST nanoseconds when the source saw it
+    int x, y;      // 0 to INPUT_EVENT_ABS_MAX, like the host's pointer
+    int pressure;  // 0 to WACOM_SAMPLE_MAX_PRESSURE
+    int distance;  // Height above the surface, 0 to WACOM_SAMPLE_MAX_DISTANCE, or -1 if the source can't tell
+    int buttons;   // 1 << INPUT_BUTTON_*, the tip is INPUT_BUTTON_LEFT
+    bool inProx, eraser;
+} WacomSample;
+
+typedef struct WacomIngest {
+    char *path; // evdev device to read, ingestion is off if NULL
+
+    int fd;
+    int stopPipe[2];
+    QemuThread thread;
+    USBEndpoint *ep;
+
+    WacomSample queue[WACOM_INGEST_QUEUE_LENGTH];
+    unsigned int head;   // Only written by the ingestion thread
+    unsigned int tail;   // Only written by the device
+    bool waiting;        // The device found the queue empty, so wake it for the next sample
+    QEMUBH *wakeBh;
+    unsigned int dropped; // Samples that arrived while the queue was full
+
+    // The ingestion thread's decoding state
+    WacomSample pending;
+    int minX, rangeX, minY, rangeY, minPressure, rangePressure, minDistance, rangeDistance;
+} WacomIngest;
+
+bool wacom_ingest_start(WacomIngest *in, USBEndpoint *ep, const char *name, Error **errp);
+void wacom_ingest_stop(WacomIngest *in);
+bool wacom_ingest_pop(WacomIngest *in, WacomSample *sample);
+
+/*
+ * Fault injection on the pen endpoint's reports, for reproducing what a congested bus does to the guest's driver.
+ * Reports can be dropped, held back by a random delay of up to "delay" ms, stalled in bursts (the whole stream is held
+ * for "delay" ms and then released back-to-back), and proximity transitions can be swapped with the report that
+ * follows them. Held reports go out in order on later polls. Decisions come from a xorshift generator started from
+ * "seed" and times are virtual milliseconds, so a run can be repeated exactly. A timer wakes the endpoint when a held
+ * report comes due. When every fault is off, reports are copied straight into the packet.
+ */
+#define WACOM_FAULT_QUEUE_LENGTH 64
+#define WACOM_FAULT_REPORT_MAX 16
+#define WACOM_FAULT_REORDER_WAIT 50 // ms a swapped proximity report waits for a report to swap with
+
+typedef struct WacomFaultReport {
+    uint8_t data[WACOM_FAULT_REPORT_MAX];
+    int len;
+    int64_t due;
+    bool swap; // Proximity report waiting for the report that will overtake it
+} WacomFaultReport;
+
+typedef struct WacomFaults {
+    uint64_t seed;
+    uint8_t drop, burst, reorder; // Percent chance per report
+    uint32_t delay;
+
+    const char *name;
+    USBEndpoint *ep;
+    QEMUTimer *timer;
+    bool enabled;
+    uint64_t state;
+    int64_t stallUntil;
+    WacomFaultReport queue[WACOM_FAULT_QUEUE_LENGTH];
+    int head, count;
+    uint32_t dropped, reordered, overflowed, oversized;
+} WacomFaults;
+
+bool wacom_faults_init(WacomFaults *f, USBEndpoint *ep, const char *name, Error **errp);
+void wacom_faults_stop(WacomFaults *f);
+void wacom_faults_reset(WacomFaults *f);
+bool wacom_faults_apply(WacomFaults *f, USBPacket *p, const uint8_t *report, int len, bool prox, int64_t now);
+
+/* Send a report, prox if it's a proximity transition. False if the faults held it back and had nothing else to send */
+static inline bool wacom_faults_send(WacomFaults *f, USBPacket *p, const uint8_t *report, int len, bool prox,
+                                     int64_t now)
+{
+    if (likely(!f->enabled)) {
+        usb_packet_copy(p, (uint8_t *) report, len);
+        return true;
+    }
+
+    return wacom_faults_apply(f, p, report, len, prox, now);
+}
+
+/* On a poll where the device has nothing new, send a report that the faults held back earlier, if one is due */
+static inline bool wacom_faults_poll(WacomFaults *f, USBPacket *p, int64_t now)
+{
+    return unlikely(f->enabled) && wacom_faults_apply(f, p, NULL, 0, false, now);
+}
+
+void wacom_model_copy(WacomModel *dst, const WacomModel *src);
+void wacom_model_free(WacomModel *m);
+bool wacom_model_load(WacomModel *m, const char *filename, const WacomModel *defaults, Error **errp);
+void wacom_desc_build(WacomDesc *d, const USBDesc *tmpl, const WacomModel *m);
+
+/*
+ * Driver bring-up profile.
+ *
+ * Records how long the guest driver takes from the moment we're attached to
+ * the bus until it switches us into Wacom mode and then receives its first
+ * pen report, along with how many control requests we had to turn away on
+ * the way there and how many repeated reports we didn't bother it with.
+ * Times are QEMU_CLOCK_REALTIME nanoseconds, 0 if the milestone hasn't been
+ * reached yet.
+ */
+typedef struct WacomBringup {
+    const char *name;
+    bool profile; /* Log every control request along with its timestamp */
+
+    int64_t attachTime;
+    int64_t wacomModeTime;
+    int64_t firstPenTime;
+
+    uint32_t controlRequests;
+    uint32_t stalledRequests;
+    uint32_t unsupportedRequests;
+    uint32_t suppressedReports;
+} WacomBringup;
+
+/* Register the bringup-stats property for a device class whose instances keep their WacomBringup at offset */
+void wacom_bringup_class_init(ObjectClass *klass, size_t offset);
+void wacom_bringup_init(WacomBringup *b, const char *name);
+void wacom_bringup_attach(WacomBringup *b);
+void wacom_bringup_control(WacomBringup *b, int request, int value, int index, int length);
+void wacom_bringup_wacom_mode(WacomBringup *b);
+void wacom_bringup_pen_report(WacomBringup *b);
+
+static inline void wacom_bringup_stall(WacomBringup *b)
+{
+    b->stalledRequests++;
+}
+
+static inline void wacom_bringup_unsupported(WacomBringup *b)
+{
+    b->unsupportedRequests++;
+}
+
+static inline void wacom_bringup_suppressed(WacomBringup *b)
+{
+    b->suppressedReports++;
+}
+
+#endif
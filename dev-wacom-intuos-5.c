@@ -29,7 +29,7 @@
  */
 
 #include "qemu/osdep.h"
-#include "ui/console.h"
+#include "ui/input.h"
 #include "hw/usb.h"
 #include "migration/vmstate.h"
 #include "qemu/module.h"
@@ -37,6 +37,9 @@
 #include "qom/object.h"
 #include "qemu/timer.h"
 #include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qapi/qapi-types-ui.h"
+#include "dev-wacom-common.h"
 
 /* Interface requests */
 #define WACOM_GET_REPORT	0x01
@@ -46,8 +49,13 @@
 #define WAC_CMD_SET_DATARATE 0x04
 #define WAC_CMD_SET_SCANMODE_PENTOUCH 0x0d
 
+/* Sensors selected by WAC_CMD_SET_SCANMODE_PENTOUCH, a mode selecting neither scans both like the tablet does at power on */
+#define WACOM_SCAN_PEN 0x01
+#define WACOM_SCAN_TOUCH 0x02
+
 #define WACOM_REPORT_PROXIMITY 5
 #define WACOM_REPORT_PENABLED 2
+#define WACOM_REPORT_INTUOS5PAD 3
 #define WACOM_REPORT_INTUOS_PEN 16
 #define WACOM_REPORT_WL 128
 #define WACOM_REPORT_USB 192
@@ -60,6 +68,7 @@
 /* HID interface requests */
 #define HID_GET_REPORT		0x01
 #define HID_GET_IDLE		0x02
+#define HID_GET_PROTOCOL    0x03
 #define HID_SET_IDLE		0x0a
 #define HID_SET_PROTOCOL    0x0b
 
@@ -68,9 +77,17 @@
 #define USB_DT_REPORT 0x22
 #define USB_DT_PHY    0x23
 
-#define PEN_LEAVE_TIMEOUT 5000
 #define PEN_PING_INTERVAL 200
 
+/*
+ * The pen's height above the tablet, in the Intuos 5's distance units. The host's pointer has no height, so the pen
+ * hovers at the hover-height property while the pointer moves, and once it goes quiet rises at lift-rate units a
+ * second until it's out of range, rather than waiting for an idle timeout. The defaults take about five seconds.
+ */
+#define INTUOS5_MAX_DISTANCE 63
+#define DEFAULT_HOVER_HEIGHT 10
+#define DEFAULT_LIFT_RATE 11
+
 #define TABLET_CLICK_PRESSURE 890
 #define TABLET_POINTER_DOWN_MIN_PRESSURE 128
 #define TABLET_MAX_PRESSURE ((1 << 11) - 1)
@@ -78,31 +95,207 @@
 #define TABLET_RESOLUTION_X 44704
 #define TABLET_RESOLUTION_Y 27940
 
+/* Limits of the Intuos 5's report format. Coordinates are 17 bits wide and pressure 11 bits */
+#define INTUOS5_MAX_COORDINATE 0x1FFFF
+#define INTUOS5_MAX_PRESSURE ((1 << 11) - 1)
+
+/* The Intuos Pro and Cintiq Pro send HID pen reports with 16-bit coordinates and 13-bit pressure */
+#define PRO_MAX_COORDINATE 0xFFFF
+#define PRO_MAX_PRESSURE ((1 << 13) - 1)
+
+#define PRO_RESOLUTION_X 44800
+#define PRO_RESOLUTION_Y 29600
+#define CINTIQ_PRO_RESOLUTION_X 59552
+#define CINTIQ_PRO_RESOLUTION_Y 33848
+
+// Bits of the Pro pen report's second byte
+#define PRO_PEN_TIP 0x01
+#define PRO_PEN_BARREL 0x02
+#define PRO_PEN_BARREL_2 0x04
+#define PRO_PEN_INVERT 0x08
+#define PRO_PEN_ERASER 0x10
+#define PRO_PEN_IN_RANGE 0x20
+
+#define PEN_REPORT_LENGTH 10
+
+/* The Wireless Accessory Kit's receiver reports its link status in reports of its own */
+#define RECEIVER_REPORT_LENGTH 32
+#define RECEIVER_CONNECTED 0x01
+#define RECEIVER_CHARGING 0x80
+#define RECEIVER_BATTERY_MAX 31
+
+// Reports waiting to cross the radio, enough for more than a 100ms interval at a 1ms poll rate
+#define LINK_QUEUE_LENGTH 128
+
 #define TABLET_NAME_QEMU "QEMU Intuos 5 tablet"
+#define TABLET_NAME_QEMU_INTUOS_PRO "QEMU Intuos Pro tablet"
+#define TABLET_NAME_QEMU_CINTIQ_PRO "QEMU Cintiq Pro pen display"
+#define TABLET_KEYS_NAME_QEMU "QEMU Intuos 5 Express Keys"
+
+// The Touch Ring's centre button followed by the eight Express Keys, in the order the pad report packs them
+#define PAD_BUTTONS 9
+#define RING_POSITIONS 72
+
+/*
+ * The tablet can track two tools in proximity at once, which it tells apart by the tool index in its proximity
+ * reports. Slot 0 follows the host's pointer, slot 1 is only ever filled by QMP.
+ */
+#define TOOL_SLOTS 2
+
+typedef struct IntuosProtocol IntuosProtocol;
+
+typedef struct IntuosToolSlot {
+    WacomTool tool, exitTool;
+    int x, y, pressure, buttons, wheel;
+    const WacomMapping *mapping; // The tablet's, for turning pressure and position into reported pressure and tilt
+    const IntuosProtocol *protocol; // The tablet's, for encoding the pen report
+
+    bool inProx;
+    bool held; // Stay in prox even when the host pointer goes idle
+    int height; // Above the surface, out of range once it's past the protocol's maxDistance
+    bool floating; // The height follows the hover model, rather than being given by the input
+
+    bool changedExit, changedProximity, changedAux, changedPen;
+    bool keepAlive; // Send the pen report even if the driver has already seen it
+
+    // The pen report as it'll next be sent, re-encoded only when the tool's state changes
+    uint8_t penReport[PEN_REPORT_LENGTH];
+    WacomReportFilter penFilter;
+
+    int64_t lastInputEventTime;
+    int64_t lastPacketTime;
+    int64_t lastHoverTime; // When the last report of the tool hovering was sent
+} IntuosToolSlot;
+
+/*
+ * The report formats spoken by the tablets in this file. They share the tool slots, control requests and data path,
+ * and differ in their descriptors, in how a slot's state is encoded, and in what their reports can carry.
+ */
+struct IntuosProtocol {
+    const char *name;
+    const USBDesc *desc; // Template descriptor, whose IDs and strings belong to the built-in model
+    const WacomModel *builtinModel;
+
+    int maxCoordinate, maxPressure;
+    int maxDistance; // Pen is in range up to this height, though only the Intuos 5 reports the height itself
+    int slots;      // How many tools the reports can tell apart
+    uint32_t tools; // Bitmask of the WacomTools the reports can describe
+    bool hasPad;
+    bool switchesMode; // Whether the driver has to switch the tablet out of HID mode before it sends these reports
+
+    void (*encodePen)(IntuosToolSlot *t, uint8_t *buf);
+
+    // Encode a tool entering or leaving prox, NULL if the prebuilt proximity reports are used instead
+    void (*encodeProx)(IntuosToolSlot *t, WacomTool tool, bool inProx, uint8_t *buf);
+};
+
+/*
+ * The radio link between the tablet and its Wireless Accessory Kit receiver. The tablet keeps sampling at the poll
+ * rate, but the radio only carries its reports across once per link interval, so the guest sees nothing for a while
+ * followed by a burst of reports back-to-back.
+ */
+typedef struct IntuosLink {
+    bool connected;
+    uint8_t battery; // Percent
+    bool charging;
+    bool changedStatus;
+
+    uint32_t interval; // Milliseconds between bursts, 0 to carry every report straight across
+    int64_t nextBurst;
+    QEMUTimer *timer;
+
+    uint8_t queue[LINK_QUEUE_LENGTH][PEN_REPORT_LENGTH];
+    int head, count;
+    int burst; // Reports left to deliver in the current burst
+    uint64_t dropped;
+} IntuosLink;
 
 typedef struct USBWacomState {
     USBDevice dev;
     USBEndpoint *intr;
-    QEMUPutMouseEntry *eh_entry;
-    USBDesc usb_desc_custom; /* If we customise product/vendor ids */
-    int dx, dy, dz, buttons_state;
-    int x, y, pressure;
+    QemuInputHandlerState *ih;
+    const IntuosProtocol *protocol;
+    WacomModel model;
+    WacomDesc desc;
+    char *model_file;
     enum {
         WACOM_MODE_HID = 1,
         WACOM_MODE_WACOM = 2,
     } mode;
     uint8_t idle;
     uint16_t product_id, vendor_id;
-    int64_t lastPacketTime;
-    
-    int64_t lastInputEventTime;
-    bool penInProx;
-    
-    bool changedPen, changedProximity;
+    uint32_t serialSalt; // Mixed into our tools' serials so that they differ between tablets
+
+    // The console whose input we follow, or NULL to follow whichever has focus
+    char *display;
+    uint32_t head;
+
+    // What the driver last told us about the features we don't emulate, reported over QMP
+    bool hasLed, hasScanMode, hasFeatureReport;
+    WacomTabletLed led;
+    uint8_t scanMode;
+    uint8_t featureReport;
+
+    // Host pointer state, gathered until the input layer syncs
+    int inputX, inputY, inputButtons, inputWheel;
+
+    IntuosToolSlot slots[TOOL_SLOTS];
+    int lastSlot;
+    bool sentProx; // The last report from usb_wacom_next_report() was a tool entering or leaving proximity
+
+    // Hover model, see DEFAULT_HOVER_HEIGHT
+    uint8_t hoverHeight;
+    uint32_t liftRate;
+    uint32_t hoverRate; // Most hover reports a second from each tool, 0 for no limit
+
+    // Leave- and enter-proximity reports for every tool in every slot, these never change
+    uint8_t proxReports[TOOL_SLOTS][WACOM_TOOL__MAX][2][PEN_REPORT_LENGTH];
+
+    WacomHidPointer hid;
+
+    char *pressure_curve, *tilt_x, *tilt_y;
+    WacomMapping mapping;
+
+    char *display_area, *active_area;
+    WacomTransform transform;
+
+    WacomLatencyProbe latency;
+    WacomIngest ingest;
+    WacomFaults faults;
+
+    // Present ourselves as a Wireless Accessory Kit receiver with the tablet paired to it
+    bool wireless;
+    USBEndpoint *receiverIntr;
+    IntuosLink link;
+
+    // Express Keys and Touch Ring
+    uint16_t padButtons; // Bit 0 is the ring's centre button, bits 1-8 the Express Keys
+    int ringPosition;
+    bool ringTouched;
+    bool changedPad;
+    uint8_t padReport[PEN_REPORT_LENGTH];
+    WacomReportFilter padFilter;
+
+    // Host keys that drive the pad, QKeyCodes or -1 if unmapped. They're typed on a console of their own
+    char *pad_keys, *ring_keys;
+    char *pad_display;
+    uint32_t pad_head;
+    int padKeyMap[PAD_BUTTONS];
+    int ringKeyMap[2]; // Anticlockwise, clockwise
+    QemuInputHandlerState *kbd;
+
+    WacomBringup bringup;
+};
+
+struct USBWacomClass {
+    USBDeviceClass parent_class;
+    const IntuosProtocol *protocol;
 };
 
 #define TYPE_USB_WACOM "usb-wacom-tablet-intuos-5"
-OBJECT_DECLARE_SIMPLE_TYPE(USBWacomState, USB_WACOM)
+#define TYPE_USB_WACOM_INTUOS_PRO "usb-wacom-tablet-intuos-pro"
+#define TYPE_USB_WACOM_CINTIQ_PRO "usb-wacom-tablet-cintiq-pro"
+OBJECT_DECLARE_TYPE(USBWacomState, USBWacomClass, USB_WACOM)
 
 enum {
     STR_SERIALNUMBER = 1,
@@ -273,7 +466,8 @@ static const USBDescIface wacom_ifaces[] = {
                     0x00,          /*  u8  country_code */
                     0x01,          /*  u8  num_descriptors */
                     USB_DT_REPORT, /*  u8  type: Report */
-                    0xF3, 0,       /*  u16 len */
+                    sizeof(interface_1_hid_report_descriptor) & 0xFF,
+                    sizeof(interface_1_hid_report_descriptor) >> 8, /*  u16 len */
                 },
             },
         },
@@ -303,7 +497,8 @@ static const USBDescIface wacom_ifaces[] = {
                     0x00,          /*  u8  country_code */
                     0x01,          /*  u8  num_descriptors */
                     USB_DT_REPORT, /*  u8  type: Report */
-                    0x17, 0x0     /*  u16 len */
+                    sizeof(interface_2_hid_report_descriptor) & 0xFF,
+                    sizeof(interface_2_hid_report_descriptor) >> 8, /*  u16 len */
                 },
             },
         },
@@ -364,184 +559,1263 @@ static const USBDesc desc_wacom_default = {
     .str  = desc_strings,
 };
 
-static inline int int_clamp(int val, int vmin, int vmax)
-{
-    if (val < vmin)
-        return vmin;
-    else if (val > vmax)
-        return vmax;
-    else
-        return val;
-}
-
-static void usb_wacom_event(void *opaque,
-                            int x, int y, int dz, int buttons_state)
-{
-    USBWacomState *s = opaque;
-
-    /* scale to tablet resolution */
-    s->x = (x * TABLET_RESOLUTION_X / 0x7FFF);
-    s->y = (y * TABLET_RESOLUTION_Y / 0x7FFF);
-    s->dz += dz;
-    s->pressure = int_clamp(s->pressure - dz * 128, TABLET_POINTER_DOWN_MIN_PRESSURE, TABLET_MAX_PRESSURE);
-    s->buttons_state = buttons_state;
-    
-    s->changedPen = true;
-    s->lastInputEventTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
-    
-    if (!s->penInProx) {
-        s->penInProx = true;
-        s->changedProximity = true;
-    }
-    
-    usb_wakeup(s->intr, 0);
-}
+/* Our built-in model, IDs and strings come from desc_wacom_default */
+static const WacomModel builtin_model = {
+    .resolutionX = TABLET_RESOLUTION_X,
+    .resolutionY = TABLET_RESOLUTION_Y,
+    .maxPressure = TABLET_MAX_PRESSURE,
+    .numInterfaces = 2,
+    .interfaces = {
+        {
+            .reportDescriptor       = interface_1_hid_report_descriptor,
+            .reportDescriptorLength = sizeof(interface_1_hid_report_descriptor),
+            .maxPacketSize          = 16,
+            .interval               = 1,
+        },
+        {
+            .reportDescriptor       = interface_2_hid_report_descriptor,
+            .reportDescriptorLength = sizeof(interface_2_hid_report_descriptor),
+            .maxPacketSize          = 64,
+            .interval               = 2,
+        },
+    },
+};
 
-#define WACOM_BUTTON_STYLUS_BUTTON_1 0x02
-#define WACOM_BUTTON_STYLUS_BUTTON_2 0x04
+static const USBDescStrings intuos_pro_strings = {
+    [STR_SERIALNUMBER]     = "QEMU:Intuos:Pro",
+    [STR_MANUFACTURER]     = "Wacom Co.,Ltd.",
+    [STR_PRODUCT]          = "Intuos Pro M"
+};
 
-#define WACOM_STYLUS_PROXIMITY 0x80
-#define WACOM_STYLUS_READY 0x40
-#define WACOM_STYLUS_IN_RANGE 0x20
+static const USBDescStrings cintiq_pro_strings = {
+    [STR_SERIALNUMBER]     = "QEMU:Cintiq:Pro",
+    [STR_MANUFACTURER]     = "Wacom Co.,Ltd.",
+    [STR_PRODUCT]          = "Cintiq Pro 13"
+};
 
-#define WACOM_STYLUS_HAS_SERIAL 0x02
-#define WACOM_STYLUS_NO_SERIAL  0x00
+#define HID_U32(v) ((v) & 0xFF), (((v) >> 8) & 0xFF), (((v) >> 16) & 0xFF), (((v) >> 24) & 0xFF)
 
-static int usb_wacom_poll(USBWacomState *s, uint8_t *buf, int len)
-{
-    int b;
-    uint16_t pressure;
-    uint8_t distance;
-    uint8_t tiltX = 0 + 64, tiltY = 0 + 64; // Tilt centered
-    
-    if (len < 10)
-        return 0;
+/*
+ * The Pro models' pen is a standard HID digitizer, laid out the way usb_wacom_pro_encode_pen() writes it. Their
+ * counts are 5µm apart, so the physical size (in units of 10µm) is half the logical one.
+ */
+#define PRO_PEN_REPORT_DESCRIPTOR(maxX, maxY)                              \
+    0x05, 0x0D,         /*  Usage Page (Digitizer),                 */     \
+    0x09, 0x02,         /*  Usage (Pen),                            */     \
+    0xA1, 0x01,         /*  Collection (Application),               */     \
+    0x85, WACOM_REPORT_INTUOS_PEN, /*  Report ID (16),              */     \
+    0x09, 0x20,         /*      Usage (Stylus),                     */     \
+    0xA1, 0x00,         /*      Collection (Physical),              */     \
+    0x09, 0x42,         /*          Usage (Tip Switch),             */     \
+    0x09, 0x44,         /*          Usage (Barrel Switch),          */     \
+    0x09, 0x5A,         /*          Usage (Secondary Barrel Switch),*/     \
+    0x09, 0x3C,         /*          Usage (Invert),                 */     \
+    0x09, 0x45,         /*          Usage (Eraser),                 */     \
+    0x09, 0x32,         /*          Usage (In Range),               */     \
+    0x15, 0x00,         /*          Logical Minimum (0),            */     \
+    0x25, 0x01,         /*          Logical Maximum (1),            */     \
+    0x75, 0x01,         /*          Report Size (1),                */     \
+    0x95, 0x06,         /*          Report Count (6),               */     \
+    0x81, 0x02,         /*          Input (Variable),               */     \
+    0x95, 0x02,         /*          Report Count (2),               */     \
+    0x81, 0x03,         /*          Input (Constant, Variable),     */     \
+    0x05, 0x01,         /*          Usage Page (Desktop),           */     \
+    0x09, 0x30,         /*          Usage (X),                      */     \
+    0x27, HID_U32(maxX), /*         Logical Maximum (maxX),         */     \
+    0x35, 0x00,         /*          Physical Minimum (0),           */     \
+    0x47, HID_U32((maxX) / 2), /*   Physical Maximum (maxX / 2),    */     \
+    0x65, 0x11,         /*          Unit (Centimeter),              */     \
+    0x55, 0x0D,         /*          Unit Exponent (-3),             */     \
+    0x75, 0x10,         /*          Report Size (16),               */     \
+    0x95, 0x01,         /*          Report Count (1),               */     \
+    0x81, 0x02,         /*          Input (Variable),               */     \
+    0x09, 0x31,         /*          Usage (Y),                      */     \
+    0x27, HID_U32(maxY), /*         Logical Maximum (maxY),         */     \
+    0x47, HID_U32((maxY) / 2), /*   Physical Maximum (maxY / 2),    */     \
+    0x81, 0x02,         /*          Input (Variable),               */     \
+    0x05, 0x0D,         /*          Usage Page (Digitizer),         */     \
+    0x09, 0x30,         /*          Usage (Tip Pressure),           */     \
+    0x27, HID_U32(PRO_MAX_PRESSURE), /* Logical Maximum (8191),     */     \
+    0x45, 0x00,         /*          Physical Maximum (0),           */     \
+    0x65, 0x00,         /*          Unit,                           */     \
+    0x55, 0x00,         /*          Unit Exponent (0),              */     \
+    0x81, 0x02,         /*          Input (Variable),               */     \
+    0x09, 0x3D,         /*          Usage (X Tilt),                 */     \
+    0x09, 0x3E,         /*          Usage (Y Tilt),                 */     \
+    0x15, 0xC0,         /*          Logical Minimum (-64),          */     \
+    0x25, 0x3F,         /*          Logical Maximum (63),           */     \
+    0x35, 0xC0,         /*          Physical Minimum (-64),         */     \
+    0x45, 0x3F,         /*          Physical Maximum (63),          */     \
+    0x65, 0x14,         /*          Unit (Degrees),                 */     \
+    0x75, 0x08,         /*          Report Size (8),                */     \
+    0x95, 0x02,         /*          Report Count (2),               */     \
+    0x81, 0x02,         /*          Input (Variable),               */     \
+    0xC0,               /*      End Collection,                     */     \
+    0xC0                /*  End Collection                          */
+
+static const uint8_t intuos_pro_pen_report_descriptor[] = {
+    PRO_PEN_REPORT_DESCRIPTOR(PRO_RESOLUTION_X, PRO_RESOLUTION_Y)
+};
 
-    b = 0;
-    
-    if (s->buttons_state & MOUSE_EVENT_RBUTTON)
-        b |= WACOM_BUTTON_STYLUS_BUTTON_1;
-    
-    if (s->buttons_state & MOUSE_EVENT_MBUTTON)
-        b |= WACOM_BUTTON_STYLUS_BUTTON_2;
+static const uint8_t cintiq_pro_pen_report_descriptor[] = {
+    PRO_PEN_REPORT_DESCRIPTOR(CINTIQ_PRO_RESOLUTION_X, CINTIQ_PRO_RESOLUTION_Y)
+};
 
-    if ((s->buttons_state & MOUSE_EVENT_LBUTTON) != 0) {
-        pressure = s->pressure;
-        distance = 0;
-     } else {
-        pressure = 0;
-        distance = 10;
+/* Pen then touch, like the Intuos 5 but without its boot mouse. The HID descriptors' lengths come from the model */
+static const USBDescIface pro_ifaces[] = {
+    {
+        .bInterfaceNumber              = 0,
+        .bNumEndpoints                 = 1,
+        .bInterfaceClass               = USB_CLASS_HID,
+        .ndesc                         = 1,
+        .descs = (USBDescOther[]) {
+            {
+                /* HID descriptor */
+                .data = (uint8_t[]) {
+                    0x09,          /*  u8  bLength */
+                    USB_DT_HID,    /*  u8  bDescriptorType */
+                    0x10, 0x01,    /*  u16 HID_class */
+                    0x00,          /*  u8  country_code */
+                    0x01,          /*  u8  num_descriptors */
+                    USB_DT_REPORT, /*  u8  type: Report */
+                    sizeof(intuos_pro_pen_report_descriptor) & 0xFF,
+                    sizeof(intuos_pro_pen_report_descriptor) >> 8, /*  u16 len */
+                },
+            },
+        },
+        .eps = (USBDescEndpoint[]) {
+            {
+                .bEndpointAddress      = USB_DIR_IN | 0x03,
+                .bmAttributes          = USB_ENDPOINT_XFER_INT,
+                .wMaxPacketSize        = 16,
+                .bInterval             = 1,
+            },
+        },
+    },
+    {
+        .bInterfaceNumber              = 1,
+        .bNumEndpoints                 = 1,
+        .bInterfaceClass               = USB_CLASS_HID,
+        .ndesc                         = 1,
+        .descs = (USBDescOther[]) {
+            {
+                /* HID descriptor */
+                .data = (uint8_t[]) {
+                    0x09,          /*  u8  bLength */
+                    USB_DT_HID,    /*  u8  bDescriptorType */
+                    0x10, 0x01,    /*  u16 HID_class */
+                    0x00,          /*  u8  country_code */
+                    0x01,          /*  u8  num_descriptors */
+                    USB_DT_REPORT, /*  u8  type: Report */
+                    sizeof(interface_2_hid_report_descriptor) & 0xFF,
+                    sizeof(interface_2_hid_report_descriptor) >> 8, /*  u16 len */
+                },
+            },
+        },
+        .eps = (USBDescEndpoint[]) {
+            {
+                .bEndpointAddress      = USB_DIR_IN | 0x02,
+                .bmAttributes          = USB_ENDPOINT_XFER_INT,
+                .wMaxPacketSize        = 64,
+                .bInterval             = 2,
+            },
+        },
     }
-    
-    buf[0] = WACOM_REPORT_PENABLED;
-    buf[1] = WACOM_STYLUS_PROXIMITY | WACOM_STYLUS_READY | WACOM_STYLUS_IN_RANGE | b | (pressure & 0x01);
-    
-    // Low bit of coords is stored in buf[9] to allow them to be 17-bit
-    buf[2] = (s->x >> 9) & 0xFF;
-    buf[3] = (s->x >> 1) & 0xFF;
-    buf[4] = (s->y >> 9) & 0xFF;
-    buf[5] = (s->y >> 1) & 0xFF;
-    
-    buf[6] = pressure >> 3;
-    buf[7] = ((pressure & 0x6) << 5) | ((tiltX >> 1) & 0x7F);
-    buf[8] = (tiltX << 7) | (tiltY & 0x7F); 
- 
-    buf[9] = (distance << 2) | ((s->x & 0x01) << 1) | (s->y & 0x01);
-       
-    return 10;
-}
-
-static int usb_wacom_prox_event(USBWacomState *s, uint8_t *buf, int len, bool inProx)
-{
-    uint8_t toolIndex = 0;
-    uint32_t toolID = 0x802; /* Intuos4/5 13HD/24HD General Pen */
-    uint32_t toolSerial = 0xFEEDC0DE;
-
-    if (len < 9) // Because WACOM_REPORT_PROXIMITY only has an 8 byte payload (in our descriptor)
-        return 0;
-    
-    buf[0] = WACOM_REPORT_PENABLED;
-    buf[1] = WACOM_STYLUS_PROXIMITY | (inProx ? WACOM_STYLUS_READY | WACOM_STYLUS_HAS_SERIAL : 0) | (toolIndex & 0x01);
-
-    buf[2] = toolID >> 4;
-    buf[3] = (toolID << 4) | (toolSerial >> 28);
-    buf[4] = toolSerial >> 20;
-    buf[5] = toolSerial >> 12;
-    buf[6] = toolSerial >> 4;
-    buf[7] = (toolSerial << 4) | ((toolID >> 16) & 0x0F);
-    buf[8] = (toolID >> 8) & 0xF0;
-    
-    return len;
-}
-
-static int usb_wacom_version_report(USBWacomState *s, uint8_t *buf, int len)
-{
-    if (len < 8)
-        return 0;
-    
-    uint32_t penVersion = 0x121112; // i.e. 18.1.1.18[.0]
-    uint16_t touchVersion = 0x1211; // i.e. 18.1.1[.0][.0] 
-
-    buf[0] = WACOM_REPORT_VERSIONS;
-    buf[1] = 0;
-
-    buf[2] = 0;
-    buf[3] = (penVersion >> 16) & 0xFF;
-    buf[4] = (penVersion >> 8) & 0xFF;
-    buf[5] = (penVersion) & 0xFF;
-    buf[6] = (touchVersion >> 8) & 0xFF;
-    buf[7] = (touchVersion) & 0xFF;
-    buf[8] = 0;
-    buf[9] = 0;
+};
 
-    return len;
-}
+static const USBDescDevice desc_device_pro = {
+    .bcdUSB                        = 0x0200,
+    .bMaxPacketSize0               = 64,
+    .bNumConfigurations            = 1,
+    .confs = (USBDescConfig[]) {
+        {
+            .bNumInterfaces        = 2,
+            .bConfigurationValue   = 1,
+            .bmAttributes          = USB_CFG_ATT_ONE,
+            .bMaxPower             = 250,
+            .nif = 2,
+            .ifs = pro_ifaces
+        },
+    },
+};
 
-static void usb_wacom_set_tablet_mode(USBWacomState *s, int mode)
-{
-    if (s->eh_entry) {
-        qemu_remove_mouse_event_handler(s->eh_entry);
-    }
+/* At high speed a bInterval of 1 is one microframe, so the pen can be polled every 125µs */
+static const USBDesc desc_wacom_intuos_pro = {
+    .id = {
+        .idVendor          = 0x056a,
+        .idProduct         = 0x0357,
+        .bcdDevice         = 0x0100,
+        .iManufacturer     = STR_MANUFACTURER,
+        .iProduct          = STR_PRODUCT,
+        .iSerialNumber     = STR_SERIALNUMBER,
+    },
+    .full = &desc_device_pro,
+    .high = &desc_device_pro,
+    .str  = intuos_pro_strings,
+};
 
-    s->mode = mode;
+static const USBDesc desc_wacom_cintiq_pro = {
+    .id = {
+        .idVendor          = 0x056a,
+        .idProduct         = 0x034f,
+        .bcdDevice         = 0x0100,
+        .iManufacturer     = STR_MANUFACTURER,
+        .iProduct          = STR_PRODUCT,
+        .iSerialNumber     = STR_SERIALNUMBER,
+    },
+    .full = &desc_device_pro,
+    .high = &desc_device_pro,
+    .str  = cintiq_pro_strings,
+};
 
-    switch (mode) {
-        case WACOM_MODE_WACOM:
-            s->eh_entry = qemu_add_mouse_event_handler(usb_wacom_event, s, 1, TABLET_NAME_QEMU);
-            break;
-        case WACOM_MODE_HID:
-        default:
-            s->eh_entry = 0;
-    }
+static const WacomModel builtin_model_intuos_pro = {
+    .resolutionX = PRO_RESOLUTION_X,
+    .resolutionY = PRO_RESOLUTION_Y,
+    .maxPressure = PRO_MAX_PRESSURE,
+    .numInterfaces = 2,
+    .interfaces = {
+        {
+            .reportDescriptor       = intuos_pro_pen_report_descriptor,
+            .reportDescriptorLength = sizeof(intuos_pro_pen_report_descriptor),
+            .maxPacketSize          = 16,
+            .interval               = 1,
+        },
+        {
+            .reportDescriptor       = interface_2_hid_report_descriptor,
+            .reportDescriptorLength = sizeof(interface_2_hid_report_descriptor),
+            .maxPacketSize          = 64,
+            .interval               = 2,
+        },
+    },
+};
 
-    if (s->eh_entry) {
-        qemu_activate_mouse_event_handler(s->eh_entry);
-    }
+static const WacomModel builtin_model_cintiq_pro = {
+    .resolutionX = CINTIQ_PRO_RESOLUTION_X,
+    .resolutionY = CINTIQ_PRO_RESOLUTION_Y,
+    .maxPressure = PRO_MAX_PRESSURE,
+    .numInterfaces = 2,
+    .interfaces = {
+        {
+            .reportDescriptor       = cintiq_pro_pen_report_descriptor,
+            .reportDescriptorLength = sizeof(cintiq_pro_pen_report_descriptor),
+            .maxPacketSize          = 16,
+            .interval               = 1,
+        },
+        {
+            .reportDescriptor       = interface_2_hid_report_descriptor,
+            .reportDescriptorLength = sizeof(interface_2_hid_report_descriptor),
+            .maxPacketSize          = 64,
+            .interval               = 2,
+        },
+    },
+};
 
-    // Start off with pen out of prox until we get some cursor events
-    s->penInProx = false;
-    s->changedPen = false;
-    s->changedProximity = true;
-}
+static const USBDescStrings receiver_strings = {
+    [STR_SERIALNUMBER]     = "QEMU:Intuos:5:WL",
+    [STR_MANUFACTURER]     = "Wacom Co.,Ltd.",
+    [STR_PRODUCT]          = "Wireless Receiver"
+};
 
-static void usb_wacom_handle_reset(USBDevice *dev)
-{
-    USBWacomState *s = (USBWacomState *) dev;
+// The receiver's status report, the tablet's own reports come through on the interfaces that follow
+static const uint8_t receiver_hid_report_descriptor[] = {
+    0x06, 0x00, 0xFF,   /*  Usage Page (FF00h),         */
+    0x09, 0x01,         /*  Usage (01h),                */
+    0xA1, 0x01,         /*  Collection (Application),   */
+    0x85, 0x80,         /*      Report ID (128),        */
+    0x09, 0x01,         /*      Usage (01h),            */
+    0x15, 0x00,         /*      Logical Minimum (0),    */
+    0x26, 0xFF, 0x00,   /*      Logical Maximum (255),  */
+    0x75, 0x08,         /*      Report Size (8),        */
+    0x95, 0x1F,         /*      Report Count (31),      */
+    0x81, 0x02,         /*      Input (Variable),       */
+    0xC0                /*  End Collection              */
+};
 
-    s->dx = 0;
-    s->dy = 0;
-    s->dz = 0;
-    s->x = 0;
-    s->y = 0;
-    s->buttons_state = 0;
-    usb_wacom_set_tablet_mode(s, WACOM_MODE_HID);
-}
+static const WacomModelInterface receiver_interface = {
+    .reportDescriptor       = receiver_hid_report_descriptor,
+    .reportDescriptorLength = sizeof(receiver_hid_report_descriptor),
+    .maxPacketSize          = RECEIVER_REPORT_LENGTH,
+    .interval               = 1,
+};
 
-static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
-               int request, int value, int index, int length, uint8_t *data)
-{
-    USBWacomState *s = (USBWacomState *) dev;
-    int ret;
+/* Interface 0 is the receiver's own, the tablet's pen and touch interfaces keep their endpoints */
+static const USBDescIface receiver_ifaces[] = {
+    {
+        .bInterfaceNumber              = 0,
+        .bNumEndpoints                 = 1,
+        .bInterfaceClass               = USB_CLASS_HID,
+        .ndesc                         = 1,
+        .descs = (USBDescOther[]) {
+            {
+                /* HID descriptor */
+                .data = (uint8_t[]) {
+                    0x09,          /*  u8  bLength */
+                    USB_DT_HID,    /*  u8  bDescriptorType */
+                    0x10, 0x01,    /*  u16 HID_class */
+                    0x00,          /*  u8  country_code */
+                    0x01,          /*  u8  num_descriptors */
+                    USB_DT_REPORT, /*  u8  type: Report */
+                    sizeof(receiver_hid_report_descriptor) & 0xFF,
+                    sizeof(receiver_hid_report_descriptor) >> 8, /*  u16 len */
+                },
+            },
+        },
+        .eps = (USBDescEndpoint[]) {
+            {
+                .bEndpointAddress      = USB_DIR_IN | 0x01,
+                .bmAttributes          = USB_ENDPOINT_XFER_INT,
+                .wMaxPacketSize        = RECEIVER_REPORT_LENGTH,
+                .bInterval             = 1,
+            },
+        },
+    },
+    {
+        .bInterfaceNumber              = 1,
+        .bNumEndpoints                 = 1,
+        .bInterfaceClass               = USB_CLASS_HID,
+        .ndesc                         = 1,
+        .descs = (USBDescOther[]) {
+            {
+                /* HID descriptor */
+                .data = (uint8_t[]) {
+                    0x09,          /*  u8  bLength */
+                    USB_DT_HID,    /*  u8  bDescriptorType */
+                    0x10, 0x01,    /*  u16 HID_class */
+                    0x00,          /*  u8  country_code */
+                    0x01,          /*  u8  num_descriptors */
+                    USB_DT_REPORT, /*  u8  type: Report */
+                    sizeof(interface_1_hid_report_descriptor) & 0xFF,
+                    sizeof(interface_1_hid_report_descriptor) >> 8, /*  u16 len */
+                },
+            },
+        },
+        .eps = (USBDescEndpoint[]) {
+            {
+                .bEndpointAddress      = USB_DIR_IN | 0x03,
+                .bmAttributes          = USB_ENDPOINT_XFER_INT,
+                .wMaxPacketSize        = 16,
+                .bInterval             = 1,
+            },
+        },
+    },
+    {
+        .bInterfaceNumber              = 2,
+        .bNumEndpoints                 = 1,
+        .bInterfaceClass               = USB_CLASS_HID,
+        .ndesc                         = 1,
+        .descs = (USBDescOther[]) {
+            {
+                /* HID descriptor */
+                .data = (uint8_t[]) {
+                    0x09,          /*  u8  bLength */
+                    USB_DT_HID,    /*  u8  bDescriptorType */
+                    0x10, 0x01,    /*  u16 HID_class */
+                    0x00,          /*  u8  country_code */
+                    0x01,          /*  u8  num_descriptors */
+                    USB_DT_REPORT, /*  u8  type: Report */
+                    sizeof(interface_2_hid_report_descriptor) & 0xFF,
+                    sizeof(interface_2_hid_report_descriptor) >> 8, /*  u16 len */
+                },
+            },
+        },
+        .eps = (USBDescEndpoint[]) {
+            {
+                .bEndpointAddress      = USB_DIR_IN | 0x02,
+                .bmAttributes          = USB_ENDPOINT_XFER_INT,
+                .wMaxPacketSize        = 64,
+                .bInterval             = 2,
+            },
+        },
+    }
+};
+
+static const USBDescDevice desc_device_receiver = {
+    .bcdUSB                        = 0x0200,
+    .bMaxPacketSize0               = 64,
+    .bNumConfigurations            = 1,
+    .confs = (USBDescConfig[]) {
+        {
+            .bNumInterfaces        = 3,
+            .bConfigurationValue   = 1,
+            .bmAttributes          = USB_CFG_ATT_ONE,
+            .bMaxPower             = 50,
+            .nif = 3,
+            .ifs = receiver_ifaces
+        },
+    },
+};
+
+static const USBDesc desc_wacom_receiver = {
+    .id = {
+        .idVendor          = 0x056a,
+        .idProduct         = 0x0084,
+        .bcdDevice         = 0x0100,
+        .iManufacturer     = STR_MANUFACTURER,
+        .iProduct          = STR_PRODUCT,
+        .iSerialNumber     = STR_SERIALNUMBER,
+    },
+    .full = &desc_device_receiver,
+    .str  = receiver_strings,
+};
+
+#define WACOM_BUTTON_STYLUS_BUTTON_1 0x02
+#define WACOM_BUTTON_STYLUS_BUTTON_2 0x04
+
+#define WACOM_MOUSE_BUTTON_LEFT 0x01
+#define WACOM_MOUSE_BUTTON_MIDDLE 0x02
+#define WACOM_MOUSE_BUTTON_RIGHT 0x04
+
+#define WACOM_MOUSE_WHEEL_UP 0x80
+#define WACOM_MOUSE_WHEEL_DOWN 0x40
+
+#define WACOM_STYLUS_PROXIMITY 0x80
+#define WACOM_STYLUS_READY 0x40
+#define WACOM_STYLUS_IN_RANGE 0x20
+
+#define WACOM_STYLUS_HAS_SERIAL 0x02
+#define WACOM_STYLUS_NO_SERIAL  0x00
+
+// Packet types other than the general pen packet, stored in bits 1-4 of byte 1
+#define WACOM_PACKET_ROTATION 0x05
+#define WACOM_PACKET_MOUSE 0x06
+#define WACOM_PACKET_AIRBRUSH_WHEEL 0x0a
+
+#define ART_PEN_ROTATION_REST 900 // Barrel rotated to 0 degrees
+#define AIRBRUSH_WHEEL_REST 0
+
+typedef struct IntuosTool {
+    uint32_t id;
+    uint32_t serial;
+} IntuosTool;
+
+static const IntuosTool intuos_tools[WACOM_TOOL__MAX] = {
+    [WACOM_TOOL_PEN]      = { 0x802, 0xFEEDC0DE },   /* Intuos4/5 13HD/24HD General Pen */
+    [WACOM_TOOL_ERASER]   = { 0x80a, 0xFEEDC0DE },   /* Its eraser end, which shares the pen's serial like the real thing */
+    [WACOM_TOOL_AIRBRUSH] = { 0x902, 0xFEEDA1B0 },   /* Intuos4/5 13HD/24HD Airbrush */
+    [WACOM_TOOL_ART_PEN]  = { 0x10804, 0xFEEDA127 }, /* Intuos4/5 13HD/24HD Art Pen */
+    [WACOM_TOOL_MOUSE]    = { 0x806, 0xFEED4D0E },   /* Intuos4/5 Mouse */
+};
+
+static inline int int_clamp(int val, int vmin, int vmax)
+{
+    if (val < vmin)
+        return vmin;
+    else if (val > vmax)
+        return vmax;
+    else
+        return val;
+}
+
+static void usb_wacom_build_prox_reports(USBWacomState *s)
+{
+    for (int index = 0; index < TOOL_SLOTS; index++) {
+        for (int tool = 0; tool < WACOM_TOOL__MAX; tool++) {
+            uint8_t *buf = s->proxReports[index][tool][true];
+            uint8_t *exitBuf = s->proxReports[index][tool][false];
+            uint32_t toolID = intuos_tools[tool].id;
+            uint32_t toolSerial = intuos_tools[tool].serial ^ s->serialSalt;
+
+            buf[0] = WACOM_REPORT_PENABLED;
+            buf[1] = WACOM_STYLUS_PROXIMITY | WACOM_STYLUS_READY | WACOM_STYLUS_HAS_SERIAL | (index & 0x01);
+
+            buf[2] = toolID >> 4;
+            buf[3] = (toolID << 4) | (toolSerial >> 28);
+            buf[4] = toolSerial >> 20;
+            buf[5] = toolSerial >> 12;
+            buf[6] = toolSerial >> 4;
+            buf[7] = (toolSerial << 4) | ((toolID >> 16) & 0x0F);
+            buf[8] = (toolID >> 8) & 0xF0;
+            buf[9] = 0;
+
+            memcpy(exitBuf, buf, PEN_REPORT_LENGTH);
+            exitBuf[1] = WACOM_STYLUS_PROXIMITY | (index & 0x01);
+        }
+    }
+}
+
+// Every pen report has the same layout for its coordinates and hover distance
+static void usb_wacom_encode_position(IntuosToolSlot *t, uint8_t *buf, uint8_t distance)
+{
+    // Low bit of coords is stored in buf[9] to allow them to be 17-bit
+    buf[2] = (t->x >> 9) & 0xFF;
+    buf[3] = (t->x >> 1) & 0xFF;
+    buf[4] = (t->y >> 9) & 0xFF;
+    buf[5] = (t->y >> 1) & 0xFF;
+
+    buf[9] = (distance << 2) | ((t->x & 0x01) << 1) | (t->y & 0x01);
+}
+
+/* How far the tool is above the tablet, as a distance the reports can carry. A tool touching down is at zero */
+static uint8_t usb_wacom_slot_distance(IntuosToolSlot *t)
+{
+    if (t->buttons & (1 << INPUT_BUTTON_LEFT)) {
+        return 0;
+    }
+
+    return MIN(t->height, INTUOS5_MAX_DISTANCE);
+}
+
+/* The Intuos 5's pen report, which also describes its mouse */
+static void usb_wacom_intuos5_encode_pen(IntuosToolSlot *t, uint8_t *buf)
+{
+    int b;
+    uint16_t pressure;
+    uint8_t distance;
+    uint8_t tiltX = WACOM_TILT_CENTER, tiltY = WACOM_TILT_CENTER;
+
+    buf[0] = WACOM_REPORT_PENABLED;
+
+    if (t->tool == WACOM_TOOL_MOUSE) {
+        b = 0;
+
+        if (t->buttons & (1 << INPUT_BUTTON_LEFT))
+            b |= WACOM_MOUSE_BUTTON_LEFT;
+        if (t->buttons & (1 << INPUT_BUTTON_MIDDLE))
+            b |= WACOM_MOUSE_BUTTON_MIDDLE;
+        if (t->buttons & (1 << INPUT_BUTTON_RIGHT))
+            b |= WACOM_MOUSE_BUTTON_RIGHT;
+
+        buf[1] = WACOM_STYLUS_PROXIMITY | WACOM_STYLUS_READY | WACOM_STYLUS_IN_RANGE | (WACOM_PACKET_MOUSE << 1);
+        buf[6] = b;
+        buf[7] = (tiltX >> 1) & 0x3F;
+        buf[8] = (tiltX << 7) | (tiltY & 0x7F);
+
+        // One wheel click per report
+        if (t->wheel > 0) {
+            buf[7] |= WACOM_MOUSE_WHEEL_UP;
+        } else if (t->wheel < 0) {
+            buf[7] |= WACOM_MOUSE_WHEEL_DOWN;
+        }
+
+        // The mouse sits on the tablet surface
+        usb_wacom_encode_position(t, buf, 0);
+
+        return;
+    }
+
+    b = 0;
+    
+    if (t->buttons & (1 << INPUT_BUTTON_RIGHT))
+        b |= WACOM_BUTTON_STYLUS_BUTTON_1;
+    
+    if (t->buttons & (1 << INPUT_BUTTON_MIDDLE))
+        b |= WACOM_BUTTON_STYLUS_BUTTON_2;
+
+    if (t->buttons & (1 << INPUT_BUTTON_LEFT)) {
+        pressure = wacom_mapping_pressure(t->mapping, t->pressure);
+     } else {
+        pressure = 0;
+    }
+    distance = usb_wacom_slot_distance(t);
+
+    tiltX = wacom_mapping_tilt_x(t->mapping, t->x);
+    tiltY = wacom_mapping_tilt_y(t->mapping, t->y);
+    
+    buf[1] = WACOM_STYLUS_PROXIMITY | WACOM_STYLUS_READY | WACOM_STYLUS_IN_RANGE | b | (pressure & 0x01);
+    
+    buf[6] = pressure >> 3;
+    buf[7] = ((pressure & 0x6) << 5) | ((tiltX >> 1) & 0x7F);
+    buf[8] = (tiltX << 7) | (tiltY & 0x7F); 
+ 
+    usb_wacom_encode_position(t, buf, distance);
+}
+
+/* The Pro models' HID pen report, whose tip is reported as the eraser's while the pen is flipped over */
+static void usb_wacom_pro_encode_pen(IntuosToolSlot *t, uint8_t *buf)
+{
+    bool eraser = t->tool == WACOM_TOOL_ERASER;
+    uint16_t pressure = 0;
+    uint8_t b = PRO_PEN_IN_RANGE;
+
+    if (eraser)
+        b |= PRO_PEN_INVERT;
+
+    if (t->buttons & (1 << INPUT_BUTTON_LEFT)) {
+        b |= eraser ? PRO_PEN_ERASER : PRO_PEN_TIP;
+        pressure = wacom_mapping_pressure(t->mapping, t->pressure);
+    }
+    if (t->buttons & (1 << INPUT_BUTTON_RIGHT))
+        b |= PRO_PEN_BARREL;
+    if (t->buttons & (1 << INPUT_BUTTON_MIDDLE))
+        b |= PRO_PEN_BARREL_2;
+
+    buf[0] = WACOM_REPORT_INTUOS_PEN;
+    buf[1] = b;
+    buf[2] = t->x & 0xFF;
+    buf[3] = t->x >> 8;
+    buf[4] = t->y & 0xFF;
+    buf[5] = t->y >> 8;
+    buf[6] = pressure & 0xFF;
+    buf[7] = pressure >> 8;
+    buf[8] = wacom_mapping_tilt_x(t->mapping, t->x) - WACOM_TILT_CENTER;
+    buf[9] = wacom_mapping_tilt_y(t->mapping, t->y) - WACOM_TILT_CENTER;
+}
+
+/* A HID pen has no proximity reports of its own, it just comes into range with nothing pressed, and leaves it */
+static void usb_wacom_pro_encode_prox(IntuosToolSlot *t, WacomTool tool, bool inProx, uint8_t *buf)
+{
+    memcpy(buf, t->penReport, PEN_REPORT_LENGTH);
+
+    buf[1] = inProx ? PRO_PEN_IN_RANGE | (tool == WACOM_TOOL_ERASER ? PRO_PEN_INVERT : 0) : 0;
+    buf[6] = 0;
+    buf[7] = 0;
+}
+
+/* Bring a slot's pen report up to date after the tool's state has changed */
+static void usb_wacom_slot_update_report(IntuosToolSlot *t)
+{
+    t->protocol->encodePen(t, t->penReport);
+}
+
+static const IntuosProtocol intuos5_protocol = {
+    .name           = TABLET_NAME_QEMU,
+    .desc           = &desc_wacom_default,
+    .builtinModel   = &builtin_model,
+    .maxCoordinate  = INTUOS5_MAX_COORDINATE,
+    .maxPressure    = INTUOS5_MAX_PRESSURE,
+    .maxDistance    = INTUOS5_MAX_DISTANCE,
+    .slots          = TOOL_SLOTS,
+    .tools          = (1 << WACOM_TOOL__MAX) - 1,
+    .hasPad         = true,
+    .switchesMode   = true,
+    .encodePen      = usb_wacom_intuos5_encode_pen,
+};
+
+/* The Pro models only have a pen, and their driver reads them as the HID digitizers they power on as */
+static const IntuosProtocol intuos_pro_protocol = {
+    .name           = TABLET_NAME_QEMU_INTUOS_PRO,
+    .desc           = &desc_wacom_intuos_pro,
+    .builtinModel   = &builtin_model_intuos_pro,
+    .maxCoordinate  = PRO_MAX_COORDINATE,
+    .maxPressure    = PRO_MAX_PRESSURE,
+    .maxDistance    = INTUOS5_MAX_DISTANCE,
+    .slots          = 1,
+    .tools          = (1 << WACOM_TOOL_PEN) | (1 << WACOM_TOOL_ERASER),
+    .encodePen      = usb_wacom_pro_encode_pen,
+    .encodeProx     = usb_wacom_pro_encode_prox,
+};
+
+static const IntuosProtocol cintiq_pro_protocol = {
+    .name           = TABLET_NAME_QEMU_CINTIQ_PRO,
+    .desc           = &desc_wacom_cintiq_pro,
+    .builtinModel   = &builtin_model_cintiq_pro,
+    .maxCoordinate  = PRO_MAX_COORDINATE,
+    .maxPressure    = PRO_MAX_PRESSURE,
+    .maxDistance    = INTUOS5_MAX_DISTANCE,
+    .slots          = 1,
+    .tools          = (1 << WACOM_TOOL_PEN) | (1 << WACOM_TOOL_ERASER),
+    .encodePen      = usb_wacom_pro_encode_pen,
+    .encodeProx     = usb_wacom_pro_encode_prox,
+};
+
+/* The report for a slot's tool entering or leaving proximity */
+static const uint8_t *usb_wacom_prox_report(USBWacomState *s, int index, WacomTool tool, bool inProx, uint8_t *buf)
+{
+    IntuosToolSlot *t = &s->slots[index];
+
+    if (!t->protocol->encodeProx)
+        return s->proxReports[index][tool][inProx];
+
+    t->protocol->encodeProx(t, tool, inProx, buf);
+
+    return buf;
+}
+
+static int usb_wacom_poll(IntuosToolSlot *t, uint8_t *buf, int len)
+{
+    if (len < PEN_REPORT_LENGTH)
+        return 0;
+
+    memcpy(buf, t->penReport, PEN_REPORT_LENGTH);
+
+    return PEN_REPORT_LENGTH;
+}
+
+/* The mouse's wheel clicks go out one per report, so move on to the next one once a report has been sent */
+static void usb_wacom_slot_wheel_sent(IntuosToolSlot *t)
+{
+    if (t->tool != WACOM_TOOL_MOUSE || t->wheel == 0)
+        return;
+
+    t->wheel += t->wheel > 0 ? -1 : 1;
+    t->changedPen = true;
+    usb_wacom_slot_update_report(t);
+}
+
+/* The airbrush's fingerwheel and the art pen's barrel rotation are sent in a packet of their own */
+static int usb_wacom_aux_report(IntuosToolSlot *t, uint8_t *buf, int len)
+{
+    uint8_t tiltX = wacom_mapping_tilt_x(t->mapping, t->x), tiltY = wacom_mapping_tilt_y(t->mapping, t->y);
+
+    if (len < PEN_REPORT_LENGTH)
+        return 0;
+
+    buf[0] = WACOM_REPORT_PENABLED;
+
+    switch (t->tool) {
+        case WACOM_TOOL_AIRBRUSH:
+            buf[1] = WACOM_STYLUS_PROXIMITY | WACOM_STYLUS_READY | WACOM_STYLUS_IN_RANGE | (WACOM_PACKET_AIRBRUSH_WHEEL << 1);
+            buf[6] = AIRBRUSH_WHEEL_REST >> 2;
+            buf[7] = ((AIRBRUSH_WHEEL_REST & 0x03) << 6) | ((tiltX >> 1) & 0x3F);
+            buf[8] = (tiltX << 7) | (tiltY & 0x7F);
+            break;
+        case WACOM_TOOL_ART_PEN:
+            buf[1] = WACOM_STYLUS_PROXIMITY | WACOM_STYLUS_READY | WACOM_STYLUS_IN_RANGE | (WACOM_PACKET_ROTATION << 1);
+            buf[6] = ART_PEN_ROTATION_REST >> 3;
+            buf[7] = (ART_PEN_ROTATION_REST & 0x07) << 5;
+            buf[8] = 0;
+            break;
+        default:
+            return 0;
+    }
+
+    usb_wacom_encode_position(t, buf, usb_wacom_slot_distance(t));
+
+    return PEN_REPORT_LENGTH;
+}
+
+/* Switch the tool in a slot. If the old tool was in prox the driver gets to see it leave before the new one arrives */
+static void usb_wacom_slot_set_tool(USBWacomState *s, int index, WacomTool tool)
+{
+    IntuosToolSlot *t = &s->slots[index];
+
+    if (t->tool == tool)
+        return;
+
+    if (t->inProx) {
+        t->exitTool = t->tool;
+        t->changedExit = true;
+        t->changedProximity = true;
+    }
+
+    t->tool = tool;
+    usb_wacom_slot_update_report(t);
+
+    info_report("%s: Tool slot %d switched to %s", object_get_typename(OBJECT(s)), index, WacomTool_str(tool));
+}
+
+static void usb_wacom_slot_set_prox(IntuosToolSlot *t, bool inProx)
+{
+    if (t->inProx != inProx) {
+        t->inProx = inProx;
+        t->changedProximity = true;
+    }
+}
+
+/* Move a tool to a new height, it's in proximity for as long as it's within range of the tablet */
+static void usb_wacom_slot_set_height(USBWacomState *s, IntuosToolSlot *t, int height)
+{
+    if (height == t->height) {
+        return;
+    }
+
+    t->height = height;
+
+    if (height > s->protocol->maxDistance) {
+        // Leaving overtakes anything the tool still had to say
+        t->changedPen = false;
+        t->keepAlive = false;
+        usb_wacom_slot_set_prox(t, false);
+    } else {
+        t->changedPen = true;
+        usb_wacom_slot_set_prox(t, true);
+        usb_wacom_slot_update_report(t);
+    }
+}
+
+// Have every slot that the driver is keeping track of send its state again
+static void usb_wacom_resend_reports(USBWacomState *s)
+{
+    for (int i = 0; i < TOOL_SLOTS; i++) {
+        if (i == 0 || s->slots[i].inProx) {
+            s->slots[i].changedPen = true;
+            s->slots[i].changedProximity = true;
+        }
+    }
+}
+
+/*
+ * While the driver has the tablet scanning touch alone, the pen's reports would only be thrown away, so the pen's
+ * stream isn't scheduled at all: the driver isn't woken for pen input, and pen keepalives stop.
+ */
+static bool usb_wacom_scanning_pen(USBWacomState *s)
+{
+    return !s->hasScanMode || (s->scanMode & WACOM_SCAN_PEN) || !(s->scanMode & WACOM_SCAN_TOUCH);
+}
+
+/* Forget whatever the radio was carrying, e.g. when the link drops */
+static void usb_wacom_link_reset(IntuosLink *l)
+{
+    l->head = 0;
+    l->count = 0;
+    l->burst = 0;
+}
+
+static void usb_wacom_link_changed(USBWacomState *s)
+{
+    s->link.changedStatus = true;
+    usb_wakeup(s->receiverIntr, 0);
+}
+
+static void usb_wacom_input_event(DeviceState *dev, QemuConsole *src, InputEvent *evt)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+    InputMoveEvent *move;
+    InputBtnEvent *btn;
+    WacomTool tool = s->slots[0].tool;
+
+    switch (evt->type) {
+        case INPUT_EVENT_KIND_ABS:
+            move = evt->u.abs.data;
+            if (move->axis == INPUT_AXIS_X) {
+                s->inputX = move->value;
+            } else if (move->axis == INPUT_AXIS_Y) {
+                s->inputY = move->value;
+            }
+            break;
+
+        case INPUT_EVENT_KIND_BTN:
+            btn = evt->u.btn.data;
+
+            switch (btn->button) {
+                case INPUT_BUTTON_WHEEL_UP:
+                    if (btn->down)
+                        s->inputWheel++;
+                    break;
+                case INPUT_BUTTON_WHEEL_DOWN:
+                    if (btn->down)
+                        s->inputWheel--;
+                    break;
+
+                // Flip the pen over to its eraser end and back
+                case INPUT_BUTTON_SIDE:
+                    if (btn->down && (tool == WACOM_TOOL_PEN || tool == WACOM_TOOL_ERASER))
+                        usb_wacom_slot_set_tool(s, 0, tool == WACOM_TOOL_PEN ? WACOM_TOOL_ERASER : WACOM_TOOL_PEN);
+                    break;
+
+                // Pick up the next tool in the box that the tablet can describe
+                case INPUT_BUTTON_EXTRA:
+                    if (btn->down) {
+                        do {
+                            tool = (tool + 1) % WACOM_TOOL__MAX;
+                        } while (!(s->protocol->tools & (1 << tool)));
+
+                        usb_wacom_slot_set_tool(s, 0, tool);
+                    }
+                    break;
+
+                default:
+                    if (btn->down) {
+                        s->inputButtons |= 1 << btn->button;
+                    } else {
+                        s->inputButtons &= ~(1 << btn->button);
+                    }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void usb_wacom_input_sync(DeviceState *dev)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+    IntuosToolSlot *t = &s->slots[0];
+
+    if (s->mode == WACOM_MODE_HID) {
+        wacom_hid_pointer_event(&s->hid, s->inputX, s->inputY, -s->inputWheel,
+            wacom_hid_pointer_buttons(s->inputButtons));
+        s->inputWheel = 0;
+
+        usb_wakeup(s->intr, 0);
+        return;
+    }
+
+    /* map the display area onto the tablet's active area */
+    t->x = wacom_transform_axis(&s->transform.x, s->inputX);
+    t->y = wacom_transform_axis(&s->transform.y, s->inputY);
+    wacom_latency_inject(&s->latency, 0, &t->x, &t->y, s->model.resolutionX, s->model.resolutionY);
+    t->buttons = s->inputButtons;
+
+    // The scrollwheel is the mouse's own wheel, for the other tools it controls the pressure
+    if (t->tool == WACOM_TOOL_MOUSE) {
+        t->wheel += s->inputWheel;
+    } else {
+        t->pressure = int_clamp(t->pressure + s->inputWheel * 128, TABLET_POINTER_DOWN_MIN_PRESSURE, s->model.maxPressure);
+    }
+    s->inputWheel = 0;
+
+    // The host's pointer touches down with its button, and hovers otherwise
+    t->height = t->buttons & (1 << INPUT_BUTTON_LEFT) ? 0 : s->hoverHeight;
+    t->floating = true;
+
+    t->changedPen = true;
+    t->held = false;
+    t->lastInputEventTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+
+    usb_wacom_slot_set_prox(t, true);
+    usb_wacom_slot_update_report(t);
+
+    if (usb_wacom_scanning_pen(s)) {
+        usb_wakeup(s->intr, 0);
+    }
+}
+
+static void usb_wacom_apply_sample(USBWacomState *s, const WacomSample *sample)
+{
+    IntuosToolSlot *t = &s->slots[0];
+
+    t->lastInputEventTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+
+    // A real pen says when it leaves, so it doesn't drift away by itself
+    t->floating = false;
+
+    if (!sample->inProx) {
+        usb_wacom_slot_set_prox(t, false);
+        return;
+    }
+
+    // The pen's other end is the eraser, any other tool chosen from the monitor stays put
+    if (sample->eraser && t->tool != WACOM_TOOL_ERASER) {
+        usb_wacom_slot_set_tool(s, 0, WACOM_TOOL_ERASER);
+    } else if (!sample->eraser && t->tool == WACOM_TOOL_ERASER) {
+        usb_wacom_slot_set_tool(s, 0, WACOM_TOOL_PEN);
+    }
+
+    t->x = wacom_transform_axis(&s->transform.x, sample->x);
+    t->y = wacom_transform_axis(&s->transform.y, sample->y);
+    wacom_latency_inject(&s->latency, sample->time, &t->x, &t->y, s->model.resolutionX, s->model.resolutionY);
+    t->pressure = (int64_t) sample->pressure * s->model.maxPressure / WACOM_SAMPLE_MAX_PRESSURE;
+    t->buttons = sample->buttons;
+
+    if (t->buttons & (1 << INPUT_BUTTON_LEFT)) {
+        t->height = 0;
+    } else if (sample->distance >= 0) {
+        t->height = (int64_t) sample->distance * s->protocol->maxDistance / WACOM_SAMPLE_MAX_DISTANCE;
+    } else {
+        t->height = s->hoverHeight;
+    }
+
+    t->changedPen = true;
+    t->held = false;
+
+    usb_wacom_slot_set_prox(t, true);
+    usb_wacom_slot_update_report(t);
+}
+
+/* Bring in what the external input source has sent since the last poll */
+static void usb_wacom_ingest(USBWacomState *s)
+{
+    IntuosToolSlot *t = &s->slots[0];
+    WacomSample sample;
+
+    if (s->mode == WACOM_MODE_WACOM && !usb_wacom_scanning_pen(s)) {
+        // The pen isn't being scanned, so its samples never happened as far as the driver is concerned
+        while (wacom_ingest_pop(&s->ingest, &sample)) {
+            continue;
+        }
+    } else if (s->mode == WACOM_MODE_WACOM) {
+        // One sample per report, so that the guest sees every one of them
+        if (!t->changedPen && !t->changedProximity && !t->changedExit && wacom_ingest_pop(&s->ingest, &sample)) {
+            usb_wacom_apply_sample(s, &sample);
+        }
+    } else {
+        // While we're a HID pointer only the latest position matters
+        while (wacom_ingest_pop(&s->ingest, &sample)) {
+            wacom_hid_pointer_event(&s->hid, sample.x, sample.y, 0, wacom_hid_pointer_buttons(sample.buttons));
+        }
+    }
+}
+
+static QemuInputHandler usb_wacom_input_handler = {
+    .name  = TABLET_NAME_QEMU,
+    .mask  = INPUT_EVENT_MASK_BTN | INPUT_EVENT_MASK_ABS,
+    .event = usb_wacom_input_event,
+    .sync  = usb_wacom_input_sync,
+};
+
+static int usb_wacom_prox_event(USBWacomState *s, int index, WacomTool tool, uint8_t *buf, int len, bool inProx)
+{
+    uint8_t report[PEN_REPORT_LENGTH];
+
+    if (len < PEN_REPORT_LENGTH)
+        return 0;
+
+    memcpy(buf, usb_wacom_prox_report(s, index, tool, inProx, report), PEN_REPORT_LENGTH);
+
+    return PEN_REPORT_LENGTH;
+}
+
+static int usb_wacom_version_report(USBWacomState *s, uint8_t *buf, int len)
+{
+    if (len < 8)
+        return 0;
+    
+    uint32_t penVersion = 0x121112; // i.e. 18.1.1.18[.0]
+    uint16_t touchVersion = 0x1211; // i.e. 18.1.1[.0][.0] 
+
+    buf[0] = WACOM_REPORT_VERSIONS;
+    buf[1] = 0;
+
+    buf[2] = 0;
+    buf[3] = (penVersion >> 16) & 0xFF;
+    buf[4] = (penVersion >> 8) & 0xFF;
+    buf[5] = (penVersion) & 0xFF;
+    buf[6] = (touchVersion >> 8) & 0xFF;
+    buf[7] = (touchVersion) & 0xFF;
+    buf[8] = 0;
+    buf[9] = 0;
+
+    return len;
+}
+
+static void usb_wacom_update_pad_report(USBWacomState *s)
+{
+    uint8_t *buf = s->padReport;
+
+    buf[0] = WACOM_REPORT_INTUOS5PAD;
+    buf[1] = 0;
+    buf[2] = s->ringTouched ? 0x80 | s->ringPosition : 0;
+    buf[3] = s->padButtons & 0x01;
+    buf[4] = s->padButtons >> 1;
+    memset(buf + 5, 0, PEN_REPORT_LENGTH - 5);
+}
+
+/* However many changes we've had since the last poll, the driver gets a single report of where we ended up */
+static void usb_wacom_pad_changed(USBWacomState *s)
+{
+    usb_wacom_update_pad_report(s);
+    s->changedPad = true;
+
+    if (s->mode == WACOM_MODE_WACOM) {
+        usb_wakeup(s->intr, 0);
+    }
+}
+
+/* Copy a report into buf unless it's a repeat that the driver doesn't need to see */
+static bool usb_wacom_report_out(WacomReportFilter *f, uint8_t *buf, const uint8_t *report, bool force)
+{
+    if (!wacom_report_filter_pass(f, report, PEN_REPORT_LENGTH, force)) {
+        return false;
+    }
+
+    memcpy(buf, report, PEN_REPORT_LENGTH);
+
+    return true;
+}
+
+static bool usb_wacom_pad_report(USBWacomState *s, uint8_t *buf)
+{
+    if (!s->changedPad)
+        return false;
+
+    s->changedPad = false;
+
+    // e.g. a key that went down and back up again between polls
+    if (!usb_wacom_report_out(&s->padFilter, buf, s->padReport, false)) {
+        wacom_bringup_suppressed(&s->bringup);
+        return false;
+    }
+
+    return true;
+}
+
+static void usb_wacom_key_event(DeviceState *dev, QemuConsole *src, InputEvent *evt)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+    InputKeyEvent *key = evt->u.key.data;
+    int qcode = qemu_input_key_value_to_qcode(key->key);
+
+    for (int i = 0; i < PAD_BUTTONS; i++) {
+        if (s->padKeyMap[i] == qcode) {
+            if (key->down) {
+                s->padButtons |= 1 << i;
+            } else {
+                s->padButtons &= ~(1 << i);
+            }
+            usb_wacom_pad_changed(s);
+            return;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (s->ringKeyMap[i] == qcode) {
+            // Holding the key down keeps the finger on the ring, and key repeat slides it around
+            if (key->down) {
+                if (s->ringTouched) {
+                    s->ringPosition = (s->ringPosition + (i ? 1 : RING_POSITIONS - 1)) % RING_POSITIONS;
+                }
+                s->ringTouched = true;
+            } else {
+                s->ringTouched = false;
+            }
+            usb_wacom_pad_changed(s);
+            return;
+        }
+    }
+
+    // Other keys typed on the pad's console have nowhere to go
+}
+
+static QemuInputHandler usb_wacom_key_handler = {
+    .name  = TABLET_KEYS_NAME_QEMU,
+    .mask  = INPUT_EVENT_MASK_KEY,
+    .event = usb_wacom_key_event,
+};
+
+static bool usb_wacom_pad_keys_mapped(USBWacomState *s)
+{
+    for (int i = 0; i < PAD_BUTTONS; i++) {
+        if (s->padKeyMap[i] >= 0)
+            return true;
+    }
+
+    return s->ringKeyMap[0] >= 0 || s->ringKeyMap[1] >= 0;
+}
+
+/* Parse a colon-separated list of QKeyCode names, where an empty entry leaves that button unmapped */
+static bool usb_wacom_parse_keys(const char *spec, int *map, int count, const char *prop, const char *name,
+                                  Error **errp)
+{
+    char **names;
+    int i;
+    bool result = true;
+
+    for (i = 0; i < count; i++) {
+        map[i] = -1;
+    }
+
+    if (!spec) {
+        return true;
+    }
+
+    names = g_strsplit(spec, ":", -1);
+
+    for (i = 0; names[i] && result; i++) {
+        if (i >= count) {
+            error_setg(errp, "%s: %s can map at most %d keys", name, prop, count);
+            result = false;
+        } else if (names[i][0]) {
+            map[i] = qapi_enum_parse(&QKeyCode_lookup, names[i], -1, errp);
+            result = map[i] >= 0;
+        }
+    }
+
+    g_strfreev(names);
+
+    return result;
+}
+
+/*
+ * The receiver has no HID mode of its own, the tablet's reports come through it just as the tablet sends them. The
+ * Pro models' HID reports are the ones their driver reads, so they start out sending them.
+ */
+static int usb_wacom_power_on_mode(USBWacomState *s)
+{
+    return s->wireless || !s->protocol->switchesMode ? WACOM_MODE_WACOM : WACOM_MODE_HID;
+}
+
+static void usb_wacom_set_tablet_mode(USBWacomState *s, int mode)
+{
+    if (s->ih) {
+        qemu_input_handler_unregister(s->ih);
+        s->ih = NULL;
+    }
+    if (s->kbd) {
+        qemu_input_handler_unregister(s->kbd);
+        s->kbd = NULL;
+    }
+
+    s->mode = mode;
+
+    switch (mode) {
+        case WACOM_MODE_WACOM:
+            s->ih = wacom_input_claim((DeviceState *) s, &usb_wacom_input_handler, s->display, s->head);
+
+            if (usb_wacom_pad_keys_mapped(s)) {
+                s->kbd = wacom_input_claim((DeviceState *) s, &usb_wacom_key_handler, s->pad_display, s->pad_head);
+            }
+
+            wacom_bringup_wacom_mode(&s->bringup);
+            break;
+        case WACOM_MODE_HID:
+        default:
+            // We don't take over the host's pointer until a HID driver starts listening to us
+            break;
+    }
+
+    s->hid.changed = false;
+
+    s->changedPad = false;
+    wacom_report_filter_reset(&s->padFilter);
+    usb_wacom_link_reset(&s->link);
+
+    // Start off with tools out of prox until we get some cursor events, except those QMP is holding there
+    for (int i = 0; i < TOOL_SLOTS; i++) {
+        IntuosToolSlot *t = &s->slots[i];
+
+        t->inProx = t->held;
+        t->changedExit = false;
+        t->changedAux = false;
+        t->changedPen = t->inProx;
+        t->changedProximity = i == 0 || t->inProx;
+        wacom_report_filter_reset(&t->penFilter);
+    }
+}
+
+static void usb_wacom_claim_input(USBWacomState *s)
+{
+    if (!s->ih) {
+        s->ih = wacom_input_claim((DeviceState *) s, &usb_wacom_input_handler, s->display, s->head);
+    }
+}
+
+static void usb_wacom_handle_reset(USBDevice *dev)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+
+    s->inputX = 0;
+    s->inputY = 0;
+    s->inputButtons = 0;
+    s->inputWheel = 0;
+
+    for (int i = 0; i < TOOL_SLOTS; i++) {
+        IntuosToolSlot *t = &s->slots[i];
+
+        t->x = 0;
+        t->y = 0;
+        t->buttons = 0;
+        t->wheel = 0;
+        t->held = false;
+        t->height = s->hoverHeight;
+        t->floating = true;
+        usb_wacom_slot_update_report(t);
+    }
+
+    s->padButtons = 0;
+    s->ringTouched = false;
+    usb_wacom_update_pad_report(s);
+
+    s->hasLed = false;
+    s->hasScanMode = false;
+    s->hasFeatureReport = false;
+
+    wacom_hid_pointer_reset(&s->hid);
+    wacom_faults_reset(&s->faults);
+    usb_wacom_set_tablet_mode(s, usb_wacom_power_on_mode(s));
+    s->link.changedStatus = true;
+
+    wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_RESET);
+}
+
+static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
+               int request, int value, int index, int length, uint8_t *data)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+    int ret;
+
+    wacom_bringup_control(&s->bringup, request, value, index, length);
 
     ret = usb_desc_handle_control(dev, p, request, value, index, length, data);
     if (ret >= 0) {
@@ -553,67 +1827,95 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
         switch (data[0]) {
             case WACOM_MODE_HID:
             case WACOM_MODE_WACOM:
-                info_report(TYPE_USB_WACOM ": Set tablet mode %d", data[0]);
+                if (!s->protocol->switchesMode) {
+                    info_report("%s: Ignoring tablet mode %d, this model only has its HID reports",
+                                object_get_typename(OBJECT(dev)), data[0]);
+                    break;
+                }
+
+                info_report("%s: Set tablet mode %d", object_get_typename(OBJECT(dev)), data[0]);
                 
                 usb_wacom_set_tablet_mode(s, data[0]);
+                wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_MODE);
                 break;
                 
             case WAC_CMD_LED_CONTROL:
-                info_report(TYPE_USB_WACOM ": Discarding LED control message");
+                info_report("%s: Discarding LED control message", object_get_typename(OBJECT(dev)));
+
+                if (length >= 5) {
+                    s->hasLed = true;
+                    s->led.status_led = data[1] & 0x03;
+                    s->led.low_luminance = data[2];
+                    s->led.high_luminance = data[3];
+                    s->led.button_luminance = data[4];
+                    wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_LED);
+                }
                 break;
 
             case 0x04:
                 switch (data[1]) {
                     // case 0x00: OEM report
                     case 0x01:
-                        info_report(TYPE_USB_WACOM ": Discarding set Bluetooth address");
+                        info_report("%s: Discarding set Bluetooth address", object_get_typename(OBJECT(dev)));
+
+                        // The receiver answers by telling the driver what it's paired with again
+                        if (s->wireless) {
+                            usb_wacom_link_changed(s);
+                        }
                         break;
                     default:
-                        info_report(TYPE_USB_WACOM ": Discarding set report %x", data[1]);
+                        info_report("%s: Discarding set report %x", object_get_typename(OBJECT(dev)), data[1]);
                 }
 
-                s->changedPen = true;
-                s->changedProximity = true;
+                s->hasFeatureReport = true;
+                s->featureReport = data[1];
+                wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_FEATURE_REPORT);
+
+                usb_wacom_resend_reports(s);
                 break;
 
             case WAC_CMD_SET_SCANMODE_PENTOUCH:
-                info_report(TYPE_USB_WACOM ": Discarding set-scanmode message");
+                s->hasScanMode = true;
+                s->scanMode = data[1];
+
+                info_report("%s: Set scan mode %02x, %s the pen", object_get_typename(OBJECT(dev)), data[1],
+                            usb_wacom_scanning_pen(s) ? "scanning" : "not scanning");
+                wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_SCAN_MODE);
 
-                s->changedPen = true;
-                s->changedProximity = true;
+                usb_wacom_resend_reports(s);
                 break;
 
             default:
-                warn_report(TYPE_USB_WACOM ": Ignoring unsupported Wacom command %02x", data[0]);
+                warn_report("%s: Ignoring unsupported Wacom command %02x", object_get_typename(OBJECT(dev)), data[0]);
+                wacom_bringup_unsupported(&s->bringup);
         }
         break;
     case ClassInterfaceOutRequest | WACOM_GET_REPORT:
-        info_report(TYPE_USB_WACOM ": Get class interface out report %x %x", data[0], value);
+        info_report("%s: Get class interface out report %x %x", object_get_typename(OBJECT(dev)), data[0], value);
 
         data[0] = 0;
         data[1] = s->mode;
         p->actual_length = 2;
         break;
     case ClassInterfaceOutRequest | HID_SET_PROTOCOL:
-        warn_report(TYPE_USB_WACOM ": Ignoring attempt to switch between boot and report protocols");
+        info_report("%s: Set %s protocol", object_get_typename(OBJECT(dev)), value == 0 ? "boot" : "report");
+
+        s->hid.bootProtocol = value == 0;
+        wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_PROTOCOL);
+        break;
+    case ClassInterfaceRequest | HID_GET_PROTOCOL:
+        data[0] = s->hid.bootProtocol ? 0 : 1;
+        p->actual_length = 1;
         break;
     case InterfaceRequest | USB_REQ_GET_DESCRIPTOR:
         switch (value >> 8) {
             case USB_DT_REPORT:
-                switch (index) {
-                    case 0:
-                        memcpy(data, interface_1_hid_report_descriptor,
-                            sizeof(interface_1_hid_report_descriptor));
-                        p->actual_length = sizeof(interface_1_hid_report_descriptor);
-                        break;
-                    case 1:
-                        memcpy(data, interface_2_hid_report_descriptor,
-                            sizeof(interface_2_hid_report_descriptor));
-                        p->actual_length = sizeof(interface_2_hid_report_descriptor);
-                        break;
-                    default:
-                        goto fail;
+                if (index >= s->desc.config.nif) {
+                    goto fail;
                 }
+
+                p->actual_length = MIN(s->desc.reportDescriptorLengths[index], length);
+                memcpy(data, s->desc.reportDescriptors[index], p->actual_length);
                 break;
             
             default:
@@ -621,11 +1923,12 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
         }
         break;
     case DeviceRequest | USB_REQ_GET_DESCRIPTOR:
-        info_report(TYPE_USB_WACOM ": Get device HID descriptor 0x%04x index 0x%04x", value, index);
+        info_report("%s: Get device HID descriptor 0x%04x index 0x%04x",
+                    object_get_typename(OBJECT(dev)), value, index);
 
         switch (value >> 8)  {
             case USB_DT_HID:
-                memcpy(data, desc_device_wacom.confs[0].ifs[(value & 0xFF) >= 1 ? 1 : 0].descs[0].data, 9);
+                memcpy(data, s->desc.hidDescData[MIN(value & 0xFF, s->desc.config.nif - 1)], 9);
                 p->actual_length = 9;
                 break;
                 
@@ -634,112 +1937,326 @@ static void usb_wacom_handle_control(USBDevice *dev, USBPacket *p,
                 goto fail;
                 
             default:
-                warn_report(TYPE_USB_WACOM ": Rejecting request for unknown device descriptor 0x%04x index 0x%02x", value, index);
+                warn_report("%s: Rejecting request for unknown device descriptor 0x%04x index 0x%02x",
+                            object_get_typename(OBJECT(dev)), value, index);
     
                 goto fail;
         }
         break;
     case EndpointOutRequest | USB_REQ_CLEAR_FEATURE:
         if (value != 0x00)
-            warn_report(TYPE_USB_WACOM ": Unknown CLEAR_FEATURE request type %x for endpoint %x", value, index & 0x0F);
+            warn_report("%s: Unknown CLEAR_FEATURE request type %x for endpoint %x",
+                        object_get_typename(OBJECT(dev)), value, index & 0x0F);
+
+        p->actual_length = 0;
+        break;
+    case ClassInterfaceRequest | HID_GET_REPORT:
+        info_report("%s: Get class interface report %x %x", object_get_typename(OBJECT(dev)), value, index);
+
+        switch (value & 0xFF) {
+            case WACOM_REQUEST_GET_MODE: 
+                data[0] = 0;
+                data[1] = s->mode;
+                p->actual_length = 2;
+                break;
+            case WACOM_REQUEST_GET_FIRST_TOOL_ID:
+                p->actual_length = 0;
+
+                for (int i = 0; i < TOOL_SLOTS; i++) {
+                    if (s->slots[i].inProx) {
+                        p->actual_length = usb_wacom_prox_event(s, i, s->slots[i].tool, data, length, true);
+                        break;
+                    }
+                }
+            break;
+            case WACOM_REQUEST_GET_VERSIONS:
+                p->actual_length = usb_wacom_version_report(s, data, length);
+            break;
+            case WACOM_HID_POINTER_REPORT_ID:
+                if (s->mode == WACOM_MODE_HID && s->hid.enabled)
+                    p->actual_length = wacom_hid_pointer_report(&s->hid, data, length);
+                break;
+            default:
+                if (s->mode == WACOM_MODE_WACOM)
+                    p->actual_length = usb_wacom_poll(&s->slots[0], data, length);
+        }
+        break;
+    case ClassInterfaceRequest | HID_GET_IDLE:
+        info_report("%s: Get idle", object_get_typename(OBJECT(dev)));
+        
+        data[0] = s->idle;
+        p->actual_length = 1;
+        break;
+    case ClassInterfaceOutRequest | HID_SET_IDLE:
+        s->idle = (uint8_t) (value >> 8);
+        wacom_tablet_state_changed(dev, WACOM_TABLET_STATE_CHANGE_IDLE_RATE);
+        break;
+    default:
+        warn_report("%s: Rejecting unsupported control request %x value %x index %x",
+                    object_get_typename(OBJECT(dev)), request, value, index);
+        wacom_bringup_unsupported(&s->bringup);
+    fail:
+        wacom_bringup_stall(&s->bringup);
+        p->status = USB_RET_STALL;
+    }
+}
+
+// Keep a slot's tool alive in the driver's eyes, or let it drift up out of range once the host pointer goes quiet
+static void usb_wacom_slot_tick(USBWacomState *s, int index, int64_t currentTime)
+{
+    IntuosToolSlot *t = &s->slots[index];
+
+    if (t->inProx && t->floating && !t->held && !(t->buttons & (1 << INPUT_BUTTON_LEFT))) {
+        usb_wacom_slot_set_height(s, t, MIN(s->hoverHeight + (currentTime - t->lastInputEventTime) * s->liftRate / 1000,
+                                            s->protocol->maxDistance + 1));
+    }
+
+    // Driver assumes pen has left if it doesn't get a ping every 1.5 seconds, so tickle it to keep it alive
+    if (currentTime - t->lastPacketTime > PEN_PING_INTERVAL) {
+        if (t->inProx) {
+            t->keepAlive = true;
+        } else if (index == 0) {
+            // Driver also doesn't like it if we go totally quiet when pen is out of prox
+            t->changedProximity = true;
+        }
+    }
+}
+
+/* Write the next report that a slot has waiting into buf, returns false if it had nothing to say */
+static bool usb_wacom_slot_report(USBWacomState *s, int index, uint8_t *buf, int64_t currentTime)
+{
+    IntuosToolSlot *t = &s->slots[index];
+    uint8_t aux[PEN_REPORT_LENGTH];
+    bool wheel, hovering, sent = true;
+
+    s->sentProx = t->changedExit || t->changedProximity;
+
+    if (t->changedExit) {
+        t->changedExit = false;
+        usb_wacom_report_out(&t->penFilter, buf, usb_wacom_prox_report(s, index, t->exitTool, false, aux), true);
+    } else if (t->changedProximity) {
+        t->changedProximity = false;
+        t->changedAux = t->inProx && (t->tool == WACOM_TOOL_AIRBRUSH || t->tool == WACOM_TOOL_ART_PEN);
+        usb_wacom_report_out(&t->penFilter, buf, usb_wacom_prox_report(s, index, t->tool, t->inProx, aux), true);
+    } else if (t->changedAux) {
+        t->changedAux = false;
+        sent = usb_wacom_aux_report(t, aux, sizeof(aux)) && usb_wacom_report_out(&t->penFilter, buf, aux, true);
+    } else if (t->changedPen || t->keepAlive) {
+        /*
+         * Hovering has a report rate of its own, so that a hovering tool doesn't flood the guest the way contact
+         * can. The first hover report after anything else (such as the tip lifting) always goes straight out.
+         */
+        hovering = t->tool != WACOM_TOOL_MOUSE && !(t->buttons & (1 << INPUT_BUTTON_LEFT));
+
+        if (hovering && !t->keepAlive && s->hoverRate && t->lastHoverTime == t->lastPacketTime &&
+                currentTime - t->lastHoverTime < 1000 / s->hoverRate) {
+            return false;
+        }
+
+        // Every wheel click has to reach the driver even though they all look the same
+        wheel = t->tool == WACOM_TOOL_MOUSE && t->wheel != 0;
+
+        if (!usb_wacom_report_out(&t->penFilter, buf, t->penReport, t->keepAlive || wheel)) {
+            // Input that didn't change anything the driver can see isn't worth an interrupt
+            t->changedPen = false;
+            wacom_bringup_suppressed(&s->bringup);
+            return false;
+        }
+
+        t->changedPen = false;
+        t->keepAlive = false;
+
+        if (index == 0) {
+            wacom_latency_sent(&s->latency);
+        }
+        usb_wacom_slot_wheel_sent(t);
+        wacom_bringup_pen_report(&s->bringup);
+
+        if (hovering) {
+            t->lastHoverTime = currentTime;
+        }
+    } else {
+        return false;
+    }
+
+    t->lastPacketTime = currentTime;
+
+    return sent;
+}
+
+/* Take turns between the slots and the pad so that a busy tool can't starve the others */
+static bool usb_wacom_next_report(USBWacomState *s, uint8_t *buf, int64_t currentTime)
+{
+    for (int i = 1; i <= TOOL_SLOTS + 1; i++) {
+        int index = (s->lastSlot + i) % (TOOL_SLOTS + 1);
+        bool sent;
+
+        // Only a pen slot's report can be a proximity change, the pad's never is
+        s->sentProx = false;
+
+        if (index == TOOL_SLOTS) {
+            sent = s->protocol->hasPad && usb_wacom_pad_report(s, buf);
+        } else {
+            sent = usb_wacom_scanning_pen(s) && usb_wacom_slot_report(s, index, buf, currentTime);
+        }
+        if (sent) {
+            s->lastSlot = index;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void usb_wacom_link_queue(IntuosLink *l, const uint8_t *report)
+{
+    // When the radio can't keep up, the oldest reports are lost
+    if (l->count == LINK_QUEUE_LENGTH) {
+        l->head = (l->head + 1) % LINK_QUEUE_LENGTH;
+        l->count--;
+        l->burst = MIN(l->burst, l->count);
+        l->dropped++;
+    }
+
+    memcpy(l->queue[(l->head + l->count) % LINK_QUEUE_LENGTH], report, PEN_REPORT_LENGTH);
+    l->count++;
+}
+
+/* Carry the tablet's reports across the radio, a burst of everything it's sampled since the last one per interval */
+static void usb_wacom_link_data(USBWacomState *s, USBPacket *p, int64_t currentTime)
+{
+    IntuosLink *l = &s->link;
+    uint8_t report[PEN_REPORT_LENGTH];
+
+    if (!l->connected) {
+        p->status = USB_RET_NAK;
+        return;
+    }
 
-        p->actual_length = 0;
-        break;
-    case ClassInterfaceRequest | HID_GET_REPORT:
-        info_report(TYPE_USB_WACOM ": Get class interface report %x %x", value, index);
+    if (usb_wacom_next_report(s, report, currentTime)) {
+        usb_wacom_link_queue(l, report);
+    }
 
-        switch (value & 0xFF) {
-            case WACOM_REQUEST_GET_MODE: 
-                data[0] = 0;
-                data[1] = s->mode;
-                p->actual_length = 2;
-                break;
-            case WACOM_REQUEST_GET_FIRST_TOOL_ID:
-                if (s->penInProx) {
-                    p->actual_length = usb_wacom_prox_event(s, data, length, s->penInProx);
-                } else {
-                    p->actual_length = 0;
-                }
-            break;
-            case WACOM_REQUEST_GET_VERSIONS:
-                p->actual_length = usb_wacom_version_report(s, data, length);
-            break;
-            default:
-                if (s->mode == WACOM_MODE_WACOM)
-                    p->actual_length = usb_wacom_poll(s, data, length);
+    // Reports sampled during a burst wait for the next one
+    if (l->burst == 0 && l->count > 0 && currentTime >= l->nextBurst) {
+        l->burst = l->count;
+        l->nextBurst = l->interval ? (currentTime / l->interval + 1) * l->interval : currentTime;
+    }
+
+    if (l->burst == 0) {
+        if (l->count > 0) {
+            timer_mod(l->timer, l->nextBurst);
         }
-        break;
-    case ClassInterfaceRequest | HID_GET_IDLE:
-        info_report(TYPE_USB_WACOM ": Get idle");
-        
-        data[0] = s->idle;
-        p->actual_length = 1;
-        break;
-    case ClassInterfaceOutRequest | HID_SET_IDLE:
-        s->idle = (uint8_t) (value >> 8);
-        break;
-    default:
-        warn_report(TYPE_USB_WACOM ": Rejecting unsupported control request %x value %x index %x", request, value, index);
-    fail:
-        p->status = USB_RET_STALL;
+        p->status = USB_RET_NAK;
+        return;
+    }
+
+    usb_packet_copy(p, l->queue[l->head], PEN_REPORT_LENGTH);
+    l->head = (l->head + 1) % LINK_QUEUE_LENGTH;
+    l->count--;
+    l->burst--;
+}
+
+static void usb_wacom_link_timer(void *opaque)
+{
+    USBWacomState *s = opaque;
+
+    usb_wakeup(s->intr, 0);
+}
+
+/* The product ID of the tablet, as the receiver reports what it's paired with */
+static uint16_t usb_wacom_tablet_product_id(USBWacomState *s)
+{
+    if (s->product_id != 0) {
+        return s->product_id;
+    }
+
+    return s->model.productId ? s->model.productId : s->protocol->desc->id.idProduct;
+}
+
+static bool usb_wacom_receiver_report(USBWacomState *s, USBPacket *p)
+{
+    IntuosLink *l = &s->link;
+    uint8_t buf[RECEIVER_REPORT_LENGTH] = { 0 };
+    uint16_t productId = usb_wacom_tablet_product_id(s);
+
+    if (!l->changedStatus || p->iov.size < RECEIVER_REPORT_LENGTH)
+        return false;
+
+    l->changedStatus = false;
+
+    buf[0] = WACOM_REPORT_WL;
+
+    if (l->connected) {
+        buf[1] = RECEIVER_CONNECTED;
+        buf[5] = (l->battery * RECEIVER_BATTERY_MAX / 100) | (l->charging ? RECEIVER_CHARGING : 0);
+        buf[6] = productId >> 8;
+        buf[7] = productId & 0xFF;
     }
+
+    usb_packet_copy(p, buf, RECEIVER_REPORT_LENGTH);
+
+    return true;
 }
 
 static void usb_wacom_handle_data(USBDevice *dev, USBPacket *p)
 {
     USBWacomState *s = (USBWacomState *) dev;
-    uint8_t buf[p->iov.size];
-    int len = 0;
+    uint8_t report[PEN_REPORT_LENGTH];
     int64_t currentTime;
 
     switch (p->pid) {
     case USB_TOKEN_IN:
         switch (p->ep->nr) {
+            case 1:
+                if (!s->wireless) {
+                    goto fail;
+                }
+
+                if (!usb_wacom_receiver_report(s, p)) {
+                    p->status = USB_RET_NAK;
+                }
+                break;
+
             case 2:
+                // No touch stream yet. Like the real tablet, it'd only be scheduled while touch is scanned and no pen is in prox
                 p->status = USB_RET_NAK;
                 break;
         
             case 3:
+                usb_wacom_ingest(s);
+
+                if (s->mode == WACOM_MODE_HID && s->hid.enabled) {
+                    usb_wacom_claim_input(s);
+
+                    if (!wacom_hid_pointer_send(&s->hid, p)) {
+                        p->status = USB_RET_NAK;
+                    }
+                    break;
+                }
+
                 if (s->mode != WACOM_MODE_WACOM) {
                     p->status = USB_RET_NAK;
                     break;
                 }
                 
                 currentTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
-                
-                // If we haven't moved the pen in the while, move it out of proximity
-                if (s->penInProx && !s->changedPen && currentTime - s->lastInputEventTime > PEN_LEAVE_TIMEOUT) {
-                    s->penInProx = false;
-                    s->changedProximity = true;
-                }
-                
-                // Driver assumes pen has left if it doesn't get a ping every 1.5 seconds, so tickle it to keep it alive
-                if (currentTime - s->lastPacketTime > PEN_PING_INTERVAL) {
-                    if (s->penInProx) {
-                        s->changedPen = true;
-                    } else {
-                        // Driver also doesn't like it if we go totally quiet when pen is out of prox
-                        s->changedProximity = true;
+
+                if (usb_wacom_scanning_pen(s)) {
+                    for (int i = 0; i < TOOL_SLOTS; i++) {
+                        usb_wacom_slot_tick(s, i, currentTime);
                     }
                 }
-                
-                if (!(s->changedPen || s->changedProximity)) {
-                    p->status = USB_RET_NAK;
-                    break;
-                }
 
-                s->lastPacketTime = currentTime;
-
-                if (s->changedProximity) {
-                    s->changedProximity = false;
-                    len = usb_wacom_prox_event(s, buf, p->iov.size, s->penInProx);
-                    usb_packet_copy(p, buf, len);
-                } else if (s->changedPen) {
-                    s->changedPen = false;
-                    len = usb_wacom_poll(s, buf, p->iov.size);
-                    usb_packet_copy(p, buf, len);
+                if (s->wireless) {
+                    usb_wacom_link_data(s, p, currentTime);
+                } else if (usb_wacom_next_report(s, report, currentTime)) {
+                    if (!wacom_faults_send(&s->faults, p, report, PEN_REPORT_LENGTH, s->sentProx, currentTime)) {
+                        p->status = USB_RET_NAK;
+                    }
+                } else if (!wacom_faults_poll(&s->faults, p, currentTime)) {
+                    p->status = USB_RET_NAK;
                 }
-                
                 break;
             default:
                 goto fail;
@@ -752,42 +2269,418 @@ static void usb_wacom_handle_data(USBDevice *dev, USBPacket *p)
     }
 }
 
+static void usb_wacom_handle_attach(USBDevice *dev)
+{
+    USBWacomState *s = (USBWacomState *) dev;
+
+    wacom_bringup_attach(&s->bringup);
+    usb_desc_attach(dev);
+}
+
 static void usb_wacom_unrealize(USBDevice *dev)
 {
     USBWacomState *s = (USBWacomState *) dev;
 
-    if (s->eh_entry) {
-        qemu_remove_mouse_event_handler(s->eh_entry);
-        s->eh_entry = 0;
+    if (s->ih) {
+        qemu_input_handler_unregister(s->ih);
+        s->ih = NULL;
     }
-    
+    if (s->kbd) {
+        qemu_input_handler_unregister(s->kbd);
+        s->kbd = NULL;
+    }
+
+    wacom_ingest_stop(&s->ingest);
+    wacom_faults_stop(&s->faults);
+
+    if (s->link.timer) {
+        timer_free(s->link.timer);
+        s->link.timer = NULL;
+    }
+    if (s->link.dropped) {
+        warn_report("%s: The radio link dropped %" PRIu64 " reports it couldn't keep up with",
+                    object_get_typename(OBJECT(dev)), s->link.dropped);
+    }
+
     dev->usb_desc = 0;
+    wacom_model_free(&s->model);
+    wacom_mapping_free(&s->mapping);
+    wacom_hid_pointer_free(&s->hid);
+    wacom_latency_close(&s->latency);
+}
+
+static void usb_wacom_init_desc(USBWacomState *s)
+{
+    WacomModel model = s->model;
+
+    if (s->wireless) {
+        // The receiver has an identity of its own, and carries the tablet's interfaces after its own one
+        memmove(&model.interfaces[1], &model.interfaces[0], sizeof(model.interfaces[0]) * model.numInterfaces);
+        model.interfaces[0] = receiver_interface;
+        model.numInterfaces++;
+        model.vendorId = 0;
+        model.productId = 0;
+        model.bcdDevice = 0;
+        model.manufacturer = NULL;
+        model.product = NULL;
+
+        wacom_desc_build(&s->desc, &desc_wacom_receiver, &model);
+    } else {
+        if (s->product_id != 0) {
+            model.productId = s->product_id;
+        }
+        if (s->vendor_id != 0) {
+            model.vendorId = s->vendor_id;
+        }
+
+        // The Pro models' pen is already a HID pointer
+        if (s->hid.enabled && s->protocol->switchesMode) {
+            wacom_hid_pointer_extend(&s->hid, &model.interfaces[0]);
+        }
+
+        wacom_desc_build(&s->desc, s->protocol->desc, &model);
+    }
+
+    s->dev.usb_desc = &s->desc.desc;
+    usb_desc_init(&s->dev);
+
+    // Every tablet gets its own serial, unless the serial property or the model file names one
+    if (s->model.serial && !s->dev.serial) {
+        usb_desc_set_string(&s->dev, STR_SERIALNUMBER, s->model.serial);
+    } else {
+        usb_desc_create_serial(&s->dev);
+    }
+    s->serialSalt = g_str_hash(usb_desc_get_string(&s->dev, STR_SERIALNUMBER));
+}
+
+/* Load and check a model, but leave it to the caller to start using it */
+static bool usb_wacom_load_model(const IntuosProtocol *protocol, const char *filename, WacomModel *model,
+                                  const char *name, Error **errp)
+{
+    if (filename) {
+        if (!wacom_model_load(model, filename, protocol->builtinModel, errp)) {
+            return false;
+        }
+    } else {
+        wacom_model_copy(model, protocol->builtinModel);
+    }
+
+    if (model->resolutionX > protocol->maxCoordinate || model->resolutionY > protocol->maxCoordinate ||
+            model->maxPressure > protocol->maxPressure) {
+        error_setg(errp, "%s: Model's resolution or pressure range is too large for our reports", name);
+        wacom_model_free(model);
+        return false;
+    }
+
+    if (model->interfaces[0].maxPacketSize < PEN_REPORT_LENGTH) {
+        error_setg(errp, "%s: Pen endpoint is too small for our reports", name);
+        wacom_model_free(model);
+        return false;
+    }
+
+    return true;
+}
+
+static void usb_wacom_swap(USBDevice *dev, WacomTabletSwap *args, Error **errp)
+{
+    USBWacomState *s = USB_WACOM(dev);
+    bool attached = dev->attached;
+    const char *model_file = args->has_model_file ? args->model_file : NULL;
+    WacomModel model;
+    WacomTransform transform;
+
+    // Load the new model first so that we stay as we are if it's no good
+    if (!usb_wacom_load_model(s->protocol, model_file, &model, object_get_typename(OBJECT(dev)), errp)) {
+        return;
+    }
+
+    // The active area and mappings are sampled at the new model's resolution
+    if (!wacom_transform_build(&transform, &model, s->display_area, s->active_area, errp) ||
+            !wacom_mapping_build(&s->mapping, &model, s->pressure_curve, s->tilt_x, s->tilt_y, errp)) {
+        wacom_model_free(&model);
+        return;
+    }
+
+    // The guest sees this as an unplug followed by a replug of a different tablet
+    if (attached) {
+        usb_device_detach(dev);
+    }
+
+    wacom_model_free(&s->model);
+    s->model = model;
+    s->transform = transform;
+    for (int i = 0; i < TOOL_SLOTS; i++) {
+        s->slots[i].x = MIN(s->slots[i].x, s->model.resolutionX);
+        s->slots[i].y = MIN(s->slots[i].y, s->model.resolutionY);
+        s->slots[i].pressure = int_clamp(s->slots[i].pressure, TABLET_POINTER_DOWN_MIN_PRESSURE, s->model.maxPressure);
+        usb_wacom_slot_update_report(&s->slots[i]);
+    }
+
+    g_free(s->model_file);
+    s->model_file = g_strdup(model_file);
+    s->vendor_id = args->has_vendorid ? args->vendorid : 0;
+    s->product_id = args->has_productid ? args->productid : 0;
+    usb_wacom_init_desc(s);
+    usb_wacom_build_prox_reports(s);
+
+    info_report("%s: Swapped to %s, vendor %04x product %04x", object_get_typename(OBJECT(dev)),
+        model_file ? model_file : "built-in model", s->desc.desc.id.idVendor, s->desc.desc.id.idProduct);
+
+    if (attached) {
+        usb_device_attach(dev, errp);
+    }
+}
+
+static void usb_wacom_set_tool(USBDevice *dev, WacomTabletSetTool *args, Error **errp)
+{
+    USBWacomState *s = USB_WACOM(dev);
+    int index = args->has_slot ? args->slot : 0;
+    IntuosToolSlot *t;
+
+    if (index >= s->protocol->slots) {
+        error_setg(errp, "%s: Tool slot must be less than %d", object_get_typename(OBJECT(dev)), s->protocol->slots);
+        return;
+    }
+    if (!(s->protocol->tools & (1 << args->tool))) {
+        error_setg(errp, "%s: This tablet can't describe the %s",
+                   object_get_typename(OBJECT(dev)), WacomTool_str(args->tool));
+        return;
+    }
+
+    t = &s->slots[index];
+
+    if (args->has_x) {
+        t->x = MIN(args->x, s->model.resolutionX);
+    }
+    if (args->has_y) {
+        t->y = MIN(args->y, s->model.resolutionY);
+    }
+
+    usb_wacom_slot_set_tool(s, index, args->tool);
+
+    // Given a height, the tool stays at it until told otherwise
+    if (args->has_distance) {
+        t->floating = false;
+        usb_wacom_slot_set_height(s, t, args->distance);
+    }
+
+    if (args->has_in_proximity) {
+        t->held = args->in_proximity;
+        usb_wacom_slot_set_prox(t, args->in_proximity);
+    }
+
+    usb_wacom_slot_update_report(t);
+
+    if (t->inProx) {
+        t->changedPen = true;
+        t->lastInputEventTime = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
+    }
+
+    if (s->mode == WACOM_MODE_WACOM) {
+        usb_wakeup(s->intr, 0);
+    }
+}
+
+static void usb_wacom_set_pad(USBDevice *dev, WacomTabletSetPad *args, Error **errp)
+{
+    USBWacomState *s = USB_WACOM(dev);
+
+    if (args->has_ring && (args->ring < -1 || args->ring >= RING_POSITIONS)) {
+        error_setg(errp, "%s: Touch Ring position must be between -1 and %d",
+                   object_get_typename(OBJECT(dev)), RING_POSITIONS - 1);
+        return;
+    }
+
+    if (args->has_express_keys) {
+        s->padButtons = (s->padButtons & 0x01) | (args->express_keys << 1);
+    }
+    if (args->has_ring_button) {
+        s->padButtons = (s->padButtons & ~0x01) | args->ring_button;
+    }
+    if (args->has_ring) {
+        s->ringTouched = args->ring >= 0;
+        if (s->ringTouched) {
+            s->ringPosition = args->ring;
+        }
+    }
+
+    usb_wacom_pad_changed(s);
+}
+
+static void usb_wacom_set_link(USBDevice *dev, WacomTabletSetLink *args, Error **errp)
+{
+    USBWacomState *s = USB_WACOM(dev);
+    IntuosLink *l = &s->link;
+
+    if (!s->wireless) {
+        error_setg(errp, "%s: Tablet isn't behind a wireless receiver, add wireless=on to the device",
+                   object_get_typename(OBJECT(dev)));
+        return;
+    }
+    if (args->has_battery && args->battery > 100) {
+        error_setg(errp, "%s: battery is a percentage, so can't be more than 100", object_get_typename(OBJECT(dev)));
+        return;
+    }
+
+    if (args->has_connected && args->connected != l->connected) {
+        l->connected = args->connected;
+        usb_wacom_link_reset(l);
+
+        // The driver builds the tablet's input devices afresh when it reconnects, so it needs to see everything again
+        if (l->connected) {
+            usb_wacom_resend_reports(s);
+        }
+    }
+    if (args->has_battery) {
+        l->battery = args->battery;
+    }
+    if (args->has_charging) {
+        l->charging = args->charging;
+    }
+
+    info_report("%s: Tablet %s, battery %d%%%s",
+                object_get_typename(OBJECT(dev)), l->connected ? "connected" : "disconnected",
+                l->battery, l->charging ? " and charging" : "");
+
+    usb_wacom_link_changed(s);
+}
+
+static void usb_wacom_query(USBDevice *dev, WacomTabletInfo *info)
+{
+    USBWacomState *s = USB_WACOM(dev);
+
+    info->mode = s->mode == WACOM_MODE_WACOM ? WACOM_TABLET_MODE_WACOM : WACOM_TABLET_MODE_HID;
+    info->boot_protocol = s->hid.bootProtocol;
+    info->idle_rate = s->idle;
+
+    if (s->hasLed) {
+        info->has_led = true;
+        info->led = g_new(WacomTabletLed, 1);
+        *info->led = s->led;
+    }
+
+    info->has_scan_mode = s->hasScanMode;
+    info->scan_mode = s->scanMode;
+    info->has_feature_report = s->hasFeatureReport;
+    info->feature_report = s->featureReport;
 }
 
 static void usb_wacom_realize(USBDevice *dev, Error **errp)
 {
     USBWacomState *s = USB_WACOM(dev);
 
-    if (s->product_id != 0 || s->vendor_id != 0) {
-        // Make a copy of the USB descriptor so we can customise the product ID
-        memcpy((char*) &s->usb_desc_custom, (char*) &desc_wacom_default, sizeof(desc_wacom_default));
+    s->protocol = USB_WACOM_GET_CLASS(dev)->protocol;
+
+    if (!s->protocol->hasPad && (s->pad_keys || s->ring_keys)) {
+        error_setg(errp, "%s: This tablet has no pad to map keys to", object_get_typename(OBJECT(dev)));
+        return;
+    }
+
+    // Bound to a console of their own, the pad's keys never come between the guest's keyboard and the rest of the VM
+    if ((s->pad_keys || s->ring_keys) && !s->pad_display) {
+        error_setg(errp, "%s: pad-keys and ring-keys need a pad-display to take their keys from",
+                   object_get_typename(OBJECT(dev)));
+        return;
+    }
 
-        s->usb_desc_custom.id.idProduct = s->product_id;
-        s->usb_desc_custom.id.idVendor = s->vendor_id;
+    if (s->wireless && s->protocol != &intuos5_protocol) {
+        error_setg(errp, "%s: Only the Intuos 5 can be used with the Wireless Accessory Kit",
+                   object_get_typename(OBJECT(dev)));
+        return;
+    }
 
-        dev->usb_desc = &s->usb_desc_custom;
-    } else {
-        dev->usb_desc = &desc_wacom_default;
+    if (s->hoverHeight > s->protocol->maxDistance) {
+        error_setg(errp, "%s: hover-height must be at most %d to be in range of the tablet",
+                   object_get_typename(OBJECT(dev)), s->protocol->maxDistance);
+        return;
+    }
+
+    // The receiver's descriptors have no HID pointer, so a guest that puts it in HID mode mustn't be sent one
+    if (s->wireless) {
+        s->hid.enabled = false;
+    }
+
+    // The radio link already decides when reports go out
+    if (s->wireless && (s->faults.drop || s->faults.delay || s->faults.reorder)) {
+        error_setg(errp, "%s: Faults can't be injected on a wireless tablet", object_get_typename(OBJECT(dev)));
+        return;
+    }
+
+    if (!usb_wacom_parse_keys(s->pad_keys, s->padKeyMap, PAD_BUTTONS, "pad-keys", object_get_typename(OBJECT(dev)),
+                              errp) ||
+            !usb_wacom_parse_keys(s->ring_keys, s->ringKeyMap, 2, "ring-keys", object_get_typename(OBJECT(dev)), errp) ||
+            !wacom_input_check_display(s->display, s->head, errp) ||
+            !wacom_input_check_display(s->pad_display, s->pad_head, errp)) {
+        return;
+    }
+
+    if (s->link.battery > 100) {
+        error_setg(errp, "%s: battery is a percentage, so can't be more than 100", object_get_typename(OBJECT(dev)));
+        return;
+    }
+
+    if (!usb_wacom_load_model(s->protocol, s->model_file, &s->model, object_get_typename(OBJECT(dev)), errp)) {
+        return;
+    }
+
+    if (!wacom_transform_build(&s->transform, &s->model, s->display_area, s->active_area, errp) ||
+            !wacom_mapping_build(&s->mapping, &s->model, s->pressure_curve, s->tilt_x, s->tilt_y, errp)) {
+        wacom_model_free(&s->model);
+        return;
+    }
+
+    if (!wacom_latency_open(&s->latency, errp)) {
+        wacom_model_free(&s->model);
+        wacom_mapping_free(&s->mapping);
+        return;
+    }
+
+    for (int i = 0; i < TOOL_SLOTS; i++) {
+        s->slots[i].tool = WACOM_TOOL_PEN;
+        s->slots[i].mapping = &s->mapping;
+        s->slots[i].protocol = s->protocol;
+        s->slots[i].pressure = int_clamp(TABLET_CLICK_PRESSURE, TABLET_POINTER_DOWN_MIN_PRESSURE, s->model.maxPressure);
+        s->slots[i].lastPacketTime = 0;
+        s->slots[i].lastInputEventTime = 0;
+        s->slots[i].lastHoverTime = -1;
+        s->slots[i].height = s->hoverHeight;
+        s->slots[i].floating = true;
+        usb_wacom_slot_update_report(&s->slots[i]);
     }
 
-    usb_desc_init(dev);
     s->intr = usb_ep_get(dev, USB_TOKEN_IN, 3);
-    s->eh_entry = 0;
-    s->pressure = TABLET_CLICK_PRESSURE;
-    s->lastPacketTime = 0;
-    s->lastInputEventTime = 0;
-    
-    usb_wacom_set_tablet_mode(s, WACOM_MODE_HID);
+
+    // These can still fail, so they come before the descriptors that would need freeing
+    if (!wacom_faults_init(&s->faults, s->intr, object_get_typename(OBJECT(dev)), errp)) {
+        wacom_latency_close(&s->latency);
+        wacom_mapping_free(&s->mapping);
+        wacom_model_free(&s->model);
+        return;
+    }
+
+    if (!wacom_ingest_start(&s->ingest, s->intr, object_get_typename(OBJECT(dev)), errp)) {
+        wacom_faults_stop(&s->faults);
+        wacom_latency_close(&s->latency);
+        wacom_mapping_free(&s->mapping);
+        wacom_model_free(&s->model);
+        return;
+    }
+
+    usb_wacom_init_desc(s);
+    usb_wacom_build_prox_reports(s);
+    s->ih = NULL;
+    s->kbd = NULL;
+    usb_wacom_update_pad_report(s);
+    wacom_bringup_init(&s->bringup, object_get_typename(OBJECT(dev)));
+
+    if (s->wireless) {
+        s->receiverIntr = usb_ep_get(dev, USB_TOKEN_IN, 1);
+        s->link.connected = true;
+        s->link.changedStatus = true;
+        s->link.timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, usb_wacom_link_timer, s);
+    }
+
+    usb_wacom_set_tablet_mode(s, usb_wacom_power_on_mode(s));
 }
 
 static const VMStateDescription vmstate_usb_wacom = {
@@ -798,6 +2691,34 @@ static const VMStateDescription vmstate_usb_wacom = {
 static Property intuos_properties[] = {
     DEFINE_PROP_UINT16("productid", struct USBWacomState, product_id, 0),
     DEFINE_PROP_UINT16("vendorid", struct USBWacomState, vendor_id, 0),
+    DEFINE_PROP_STRING("model-file", struct USBWacomState, model_file),
+    DEFINE_PROP_STRING("pad-keys", struct USBWacomState, pad_keys),
+    DEFINE_PROP_STRING("ring-keys", struct USBWacomState, ring_keys),
+    DEFINE_PROP_STRING("pad-display", struct USBWacomState, pad_display),
+    DEFINE_PROP_UINT32("pad-head", struct USBWacomState, pad_head, 0),
+    DEFINE_PROP_BOOL("hid-pointer", struct USBWacomState, hid.enabled, true),
+    DEFINE_PROP_STRING("pressure-curve", struct USBWacomState, pressure_curve),
+    DEFINE_PROP_STRING("display-area", struct USBWacomState, display_area),
+    DEFINE_PROP_STRING("active-area", struct USBWacomState, active_area),
+    DEFINE_PROP_STRING("display", struct USBWacomState, display),
+    DEFINE_PROP_STRING("latency-log", struct USBWacomState, latency.logFile),
+    DEFINE_PROP_STRING("evdev", struct USBWacomState, ingest.path),
+    DEFINE_PROP_UINT32("head", struct USBWacomState, head, 0),
+    DEFINE_PROP_STRING("tilt-x", struct USBWacomState, tilt_x),
+    DEFINE_PROP_STRING("tilt-y", struct USBWacomState, tilt_y),
+    DEFINE_PROP_BOOL("bringup-profile", struct USBWacomState, bringup.profile, false),
+    DEFINE_PROP_BOOL("wireless", struct USBWacomState, wireless, false),
+    DEFINE_PROP_UINT32("link-interval", struct USBWacomState, link.interval, 0),
+    DEFINE_PROP_UINT8("battery", struct USBWacomState, link.battery, 100),
+    DEFINE_PROP_BOOL("charging", struct USBWacomState, link.charging, false),
+    DEFINE_PROP_UINT8("hover-height", struct USBWacomState, hoverHeight, DEFAULT_HOVER_HEIGHT),
+    DEFINE_PROP_UINT32("lift-rate", struct USBWacomState, liftRate, DEFAULT_LIFT_RATE),
+    DEFINE_PROP_UINT32("hover-rate", struct USBWacomState, hoverRate, 0),
+    DEFINE_PROP_UINT64("fault-seed", struct USBWacomState, faults.seed, 1),
+    DEFINE_PROP_UINT8("fault-drop", struct USBWacomState, faults.drop, 0),
+    DEFINE_PROP_UINT32("fault-delay", struct USBWacomState, faults.delay, 0),
+    DEFINE_PROP_UINT8("fault-burst", struct USBWacomState, faults.burst, 0),
+    DEFINE_PROP_UINT8("fault-reorder", struct USBWacomState, faults.reorder, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -805,6 +2726,9 @@ static void usb_wacom_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     USBDeviceClass *uc = USB_DEVICE_CLASS(klass);
+    WacomTabletClass *wc = WACOM_TABLET_CLASS(klass);
+
+    USB_WACOM_CLASS(klass)->protocol = &intuos5_protocol;
 
     uc->product_desc   = TABLET_NAME_QEMU;
     uc->usb_desc       = &desc_wacom_default;
@@ -813,26 +2737,81 @@ static void usb_wacom_class_init(ObjectClass *klass, void *data)
     uc->handle_control = usb_wacom_handle_control;
     uc->handle_data    = usb_wacom_handle_data;
     uc->unrealize      = usb_wacom_unrealize;
-    uc->handle_attach  = usb_desc_attach;
+    uc->handle_attach  = usb_wacom_handle_attach;
 
     set_bit(DEVICE_CATEGORY_INPUT, dc->categories);
     dc->desc = TABLET_NAME_QEMU;
     dc->vmsd = &vmstate_usb_wacom;
 
+    wc->swap = usb_wacom_swap;
+    wc->set_tool = usb_wacom_set_tool;
+    wc->set_pad = usb_wacom_set_pad;
+    wc->set_link = usb_wacom_set_link;
+    wc->query = usb_wacom_query;
+
     device_class_set_props(dc, intuos_properties);
+    wacom_bringup_class_init(klass, offsetof(USBWacomState, bringup));
+}
+
+/* The Pro models share everything but their protocol, which comes in as the class data */
+static void usb_wacom_pro_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    USBDeviceClass *uc = USB_DEVICE_CLASS(klass);
+    WacomTabletClass *wc = WACOM_TABLET_CLASS(klass);
+    USBWacomClass *c = USB_WACOM_CLASS(klass);
+
+    c->protocol = data;
+
+    uc->product_desc = c->protocol->name;
+    uc->usb_desc = c->protocol->desc;
+    dc->desc = c->protocol->name;
+
+    wc->set_pad = NULL;
+    wc->set_link = NULL;
 }
 
 static const TypeInfo wacom_info = {
     .name          = TYPE_USB_WACOM,
     .parent        = TYPE_USB_DEVICE,
     .instance_size = sizeof(USBWacomState),
+    .class_size    = sizeof(USBWacomClass),
     .class_init    = usb_wacom_class_init,
+    .interfaces    = (InterfaceInfo[]) {
+        { TYPE_WACOM_TABLET },
+        { }
+    },
+};
+
+static const TypeInfo wacom_intuos_pro_info = {
+    .name          = TYPE_USB_WACOM_INTUOS_PRO,
+    .parent        = TYPE_USB_WACOM,
+    .class_init    = usb_wacom_pro_class_init,
+    .class_data    = (void *) &intuos_pro_protocol,
+};
+
+static const TypeInfo wacom_cintiq_pro_info = {
+    .name          = TYPE_USB_WACOM_CINTIQ_PRO,
+    .parent        = TYPE_USB_WACOM,
+    .class_init    = usb_wacom_pro_class_init,
+    .class_data    = (void *) &cintiq_pro_protocol,
 };
 
 static void usb_wacom_register_types(void)
 {
     type_register_static(&wacom_info);
+    type_register_static(&wacom_intuos_pro_info);
+    type_register_static(&wacom_cintiq_pro_info);
     usb_legacy_register(TYPE_USB_WACOM, "wacom-tablet-intuos-5", NULL);
+    usb_legacy_register(TYPE_USB_WACOM_INTUOS_PRO, "wacom-tablet-intuos-pro", NULL);
+    usb_legacy_register(TYPE_USB_WACOM_CINTIQ_PRO, "wacom-tablet-cintiq-pro", NULL);
 }
 
 type_init(usb_wacom_register_types)
+
+// Newer QEMUs use this to find which module to load for our device type
+#ifdef module_obj
+module_obj(TYPE_USB_WACOM);
+module_obj(TYPE_USB_WACOM_INTUOS_PRO);
+module_obj(TYPE_USB_WACOM_CINTIQ_PRO);
+#endif
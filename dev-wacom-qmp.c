@@ -0,0 +1,186 @@
+/*
+ * QMP control of the emulated Wacom tablets.
+ *
+ * Copyright (c) 2020 Nicholas Sherlock <n.sherlock@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-wacom.h"
+#include "qapi/qapi-events-wacom.h"
+#include "qemu/module.h"
+#include "qom/object.h"
+#include "sysemu/replay.h"
+#include "hw/usb.h"
+#include "dev-wacom-common.h"
+
+/*
+ * Find a tablet for a command that changes what it reports to the guest. These changes don't go through the input
+ * layer, so record/replay wouldn't capture them, and a replay would drift away from what was recorded.
+ */
+static USBDevice *wacom_tablet_find(const char *id, Error **errp)
+{
+    bool ambiguous = false;
+    Object *obj;
+
+    if (replay_mode != REPLAY_MODE_NONE) {
+        error_setg(errp, "Emulated Wacom tablets can't be driven by QMP during record/replay");
+        return NULL;
+    }
+
+    obj = object_resolve_path_type(id, TYPE_WACOM_TABLET, &ambiguous);
+
+    if (!obj) {
+        if (ambiguous) {
+            error_setg(errp, "Path '%s' is ambiguous", id);
+        } else {
+            error_setg(errp, "'%s' is not an emulated Wacom tablet", id);
+        }
+        return NULL;
+    }
+
+    return USB_DEVICE(obj);
+}
+
+void qmp_wacom_tablet_swap(WacomTabletSwap *args, Error **errp)
+{
+    USBDevice *dev = wacom_tablet_find(args->id, errp);
+
+    if (dev) {
+        WACOM_TABLET_GET_CLASS(dev)->swap(dev, args, errp);
+    }
+}
+
+void qmp_wacom_tablet_set_tool(WacomTabletSetTool *args, Error **errp)
+{
+    USBDevice *dev = wacom_tablet_find(args->id, errp);
+    WacomTabletClass *wc;
+
+    if (!dev) {
+        return;
+    }
+
+    wc = WACOM_TABLET_GET_CLASS(dev);
+    if (!wc->set_tool) {
+        error_setg(errp, "'%s' doesn't support switching tools", args->id);
+        return;
+    }
+
+    wc->set_tool(dev, args, errp);
+}
+
+void qmp_wacom_tablet_set_pad(WacomTabletSetPad *args, Error **errp)
+{
+    USBDevice *dev = wacom_tablet_find(args->id, errp);
+    WacomTabletClass *wc;
+
+    if (!dev) {
+        return;
+    }
+
+    wc = WACOM_TABLET_GET_CLASS(dev);
+    if (!wc->set_pad) {
+        error_setg(errp, "'%s' has no Express Keys or Touch Ring", args->id);
+        return;
+    }
+
+    wc->set_pad(dev, args, errp);
+}
+
+void qmp_wacom_tablet_set_link(WacomTabletSetLink *args, Error **errp)
+{
+    USBDevice *dev = wacom_tablet_find(args->id, errp);
+    WacomTabletClass *wc;
+
+    if (!dev) {
+        return;
+    }
+
+    wc = WACOM_TABLET_GET_CLASS(dev);
+    if (!wc->set_link) {
+        error_setg(errp, "'%s' can't be used wirelessly", args->id);
+        return;
+    }
+
+    wc->set_link(dev, args, errp);
+}
+
+static WacomTabletInfo *wacom_tablet_query(USBDevice *dev)
+{
+    WacomTabletInfo *info = g_new0(WacomTabletInfo, 1);
+    DeviceState *d = DEVICE(dev);
+
+    info->has_id = d->id != NULL;
+    info->id = g_strdup(d->id);
+    info->path = object_get_canonical_path(OBJECT(dev));
+    info->type = g_strdup(object_get_typename(OBJECT(dev)));
+
+    WACOM_TABLET_GET_CLASS(dev)->query(dev, info);
+
+    return info;
+}
+
+void wacom_tablet_state_changed(USBDevice *dev, WacomTabletStateChange change)
+{
+    WacomTabletInfo *info = wacom_tablet_query(dev);
+
+    qapi_event_send_wacom_tablet_state_changed(change, info);
+    qapi_free_WacomTabletInfo(info);
+}
+
+static int wacom_tablet_query_one(Object *obj, void *opaque)
+{
+    WacomTabletInfoList **list = opaque;
+    WacomTabletInfoList *entry;
+
+    if (!object_dynamic_cast(obj, TYPE_WACOM_TABLET) || !DEVICE(obj)->realized) {
+        return 0;
+    }
+
+    entry = g_new0(WacomTabletInfoList, 1);
+    entry->value = wacom_tablet_query(USB_DEVICE(obj));
+    entry->next = *list;
+    *list = entry;
+
+    return 0;
+}
+
+WacomTabletInfoList *qmp_query_wacom_tablets(Error **errp)
+{
+    WacomTabletInfoList *list = NULL;
+
+    object_child_foreach_recursive(object_get_root(), wacom_tablet_query_one, &list);
+
+    return list;
+}
+
+static const TypeInfo wacom_tablet_info = {
+    .name          = TYPE_WACOM_TABLET,
+    .parent        = TYPE_INTERFACE,
+    .class_size    = sizeof(WacomTabletClass),
+};
+
+static void wacom_tablet_register_types(void)
+{
+    type_register_static(&wacom_tablet_info);
+}
+
+type_init(wacom_tablet_register_types)
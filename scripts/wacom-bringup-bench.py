@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+#
+# Hot-plug each emulated Wacom tablet into a running guest and measure how
+# long the guest driver takes to bring it up.
+#
+# Start QEMU with a QMP socket and a USB controller, boot the guest, then run
+# e.g.:
+#
+#   qemu ... -device qemu-xhci,id=xhci -qmp unix:/tmp/qmp.sock,server,nowait
+#   scripts/wacom-bringup-bench.py /tmp/qmp.sock --runs 5
+#
+# Copyright (c) 2020 Nicholas Sherlock <n.sherlock@gmail.com>
+#
+# This work is licensed under the MIT license, see the file headers of the
+# tablet devices for details.
+
+import argparse
+import json
+import socket
+import sys
+import time
+
+MODELS = ['usb-wacom-tablet-bamboo', 'usb-wacom-tablet-intuos-5']
+DEVICE_ID = 'wacom-bench'
+
+
+class QMP:
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.file = self.sock.makefile('rw')
+        self.events = []
+        self._read()  # Greeting
+        self.cmd('qmp_capabilities')
+
+    def _read(self):
+        line = self.file.readline()
+        if not line:
+            raise EOFError('QMP connection closed')
+        return json.loads(line)
+
+    def cmd(self, name, **args):
+        self.file.write(json.dumps({'execute': name, 'arguments': args}) + '\n')
+        self.file.flush()
+        while True:
+            resp = self._read()
+            if 'event' in resp:
+                self.events.append(resp)
+                continue
+            if 'error' in resp:
+                raise RuntimeError('%s: %s' % (name, resp['error']['desc']))
+            return resp['return']
+
+    def wait_event(self, name, timeout):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            for ev in self.events:
+                if ev['event'] == name:
+                    self.events.remove(ev)
+                    return ev
+            self.sock.settimeout(max(deadline - time.monotonic(), 0.01))
+            try:
+                self.events.append(self._read())
+            except socket.timeout:
+                pass
+            finally:
+                self.sock.settimeout(None)
+        return None
+
+
+def wiggle(qmp, step):
+    # Pen reports are only sent in response to input, so keep the pointer moving
+    x = 0x2000 + (step % 64) * 64
+    qmp.cmd('input-send-event', events=[
+        {'type': 'abs', 'data': {'axis': 'x', 'value': x}},
+        {'type': 'abs', 'data': {'axis': 'y', 'value': 0x2000}},
+    ])
+
+
+def bench(qmp, driver, args):
+    props = {'driver': driver, 'id': DEVICE_ID, 'bringup-profile': args.profile}
+    if args.bus:
+        props['bus'] = args.bus
+
+    qmp.cmd('device_add', **props)
+
+    path = '/machine/peripheral/' + DEVICE_ID
+    deadline = time.monotonic() + args.timeout
+    step = 0
+    stats = None
+
+    while time.monotonic() < deadline:
+        stats = qmp.cmd('qom-get', path=path, property='bringup-stats')
+        if stats['attach-to-first-pen-us'] >= 0:
+            break
+        if stats['attach-to-wacom-mode-us'] >= 0:
+            wiggle(qmp, step)
+            step += 1
+        time.sleep(args.interval)
+
+    qmp.cmd('device_del', id=DEVICE_ID)
+    if not qmp.wait_event('DEVICE_DELETED', args.timeout):
+        sys.exit('%s: timed out waiting for the guest to release the device' % driver)
+
+    return stats
+
+
+def fmt_ms(us):
+    return '%9.1f' % (us / 1000.0) if us >= 0 else '  timeout'
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure Wacom tablet driver bring-up time')
+    parser.add_argument('qmp', help='path to the QMP UNIX socket')
+    parser.add_argument('--model', action='append', choices=MODELS,
+                        help='tablet model to test (default: all)')
+    parser.add_argument('--bus', help='USB bus to attach to, e.g. xhci.0')
+    parser.add_argument('--runs', type=int, default=1, help='attach/detach cycles per model')
+    parser.add_argument('--timeout', type=float, default=60, help='seconds to wait for each milestone')
+    parser.add_argument('--interval', type=float, default=0.02, help='seconds between polls')
+    parser.add_argument('--profile', action='store_true',
+                        help='have QEMU log every control request with its timestamp')
+    args = parser.parse_args()
+
+    qmp = QMP(args.qmp)
+
+    print('%-28s %4s %12s %12s %8s %8s %12s %11s' %
+          ('model', 'run', 'mode (ms)', 'pen (ms)', 'requests', 'stalled', 'unsupported', 'suppressed'))
+
+    for driver in args.model or MODELS:
+        for run in range(args.runs):
+            s = bench(qmp, driver, args)
+            print('%-28s %4d %12s %12s %8d %8d %12d %11d' %
+                  (driver, run, fmt_ms(s['attach-to-wacom-mode-us']),
+                   fmt_ms(s['attach-to-first-pen-us']), s['control-requests'],
+                   s['stalled-requests'], s['unsupported-requests'], s['suppressed-reports']))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+#
+# Join an emulated Wacom tablet's latency log with what the guest's reader
+# saw, and report the latency and fate of every sample.
+#
+# Start QEMU with the tablet's latency probe on, run the reader in the guest
+# (see tools/wacom-latency-reader.c) while moving the pointer over the VM's
+# window, then join the two logs:
+#
+#   qemu ... -device usb-wacom-tablet-intuos-5,latency-log=/tmp/host.log
+#   scripts/wacom-latency-join.py /tmp/host.log guest.log
+#
+# Latencies are only meaningful if the guest's clock is synchronised with the
+# host's (e.g. with chrony and the KVM PTP clock). Otherwise use --offset auto,
+# which takes the fastest sample as having no latency at all, so that the
+# results are relative to it.
+#
+# Copyright (c) 2020 Nicholas Sherlock <n.sherlock@gmail.com>
+#
+# This work is licensed under the MIT license, see the file headers of the
+# tablet devices for details.
+
+import argparse
+import sys
+
+# Must match WACOM_LATENCY_SEQ_BITS in dev-wacom-common.h
+SEQ_BITS = 6
+SEQ_MODULO = 1 << (SEQ_BITS * 2)
+
+
+def read_host_log(path):
+    injected, sent = {}, {}
+    with open(path) as f:
+        for line in f:
+            if line.startswith('#') or not line.strip():
+                continue
+            event, seq, when = line.split()
+            (injected if event == 'inject' else sent)[int(seq)] = int(when)
+    return injected, sent
+
+
+def read_guest_log(path):
+    samples = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if not fields or fields[0] in ('#', 'missing'):
+                continue
+            samples.append((int(fields[0]), int(fields[1])))
+    return samples
+
+
+def unwrap(samples, injected):
+    """Work out the full sequence number of each of the guest's truncated ones"""
+    seqs = sorted(injected)
+    if not seqs or not samples:
+        return []
+
+    # The reader may have started long after the tablet did, so place its first
+    # sample by time, then follow on from there
+    first, when = samples[0]
+    candidates = [s for s in seqs if s % SEQ_MODULO == first and injected[s] <= when]
+    last = candidates[-1] if candidates else seqs[0] - 1
+
+    result = []
+    for i, (seq, when) in enumerate(samples):
+        if i == 0 and candidates:
+            full = last
+        else:
+            full = last + 1 + (seq - (last + 1)) % SEQ_MODULO
+        if full not in injected:
+            continue
+        result.append((full, when))
+        last = full
+    return result
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Join a Wacom tablet latency log with the guest reader's output")
+    parser.add_argument('host_log', help="the tablet's latency-log")
+    parser.add_argument('guest_log', help="wacom-latency-reader's output")
+    parser.add_argument('--offset', default='0',
+                        help="nanoseconds to subtract from the guest's times, or 'auto'")
+    parser.add_argument('--summary', action='store_true', help="only print the summary")
+    args = parser.parse_args()
+
+    injected, sent = read_host_log(args.host_log)
+    seen = dict(unwrap(read_guest_log(args.guest_log), injected))
+
+    if not seen:
+        sys.exit('No samples in the guest log match the host log')
+
+    if args.offset == 'auto':
+        offset = min(when - injected[seq] for seq, when in seen.items())
+    else:
+        offset = int(args.offset)
+
+    latencies = []
+    counts = {'delivered': 0, 'overtaken': 0, 'lost': 0}
+
+    if not args.summary:
+        print('%8s %12s %12s %12s  %s' % ('sequence', 'to-guest-us', 'in-guest-us', 'total-us', 'fate'))
+
+    # Only samples from while the reader was running are counted
+    for seq in range(min(seen), max(seen) + 1):
+        if seq not in injected:
+            continue
+
+        if seq in seen:
+            fate = 'delivered'
+            total = (seen[seq] - offset - injected[seq]) / 1000
+            latencies.append(total)
+        elif seq in sent:
+            fate = 'lost'       # Handed to the guest but the reader never saw it
+        else:
+            fate = 'overtaken'  # Replaced by a later sample before the guest polled
+        counts[fate] += 1
+
+        if not args.summary:
+            to_guest = '%.0f' % ((sent[seq] - injected[seq]) / 1000) if seq in sent else '-'
+            in_guest = '%.0f' % ((seen[seq] - offset - sent[seq]) / 1000) if seq in seen and seq in sent else '-'
+            print('%8d %12s %12s %12s  %s' % (seq, to_guest, in_guest,
+                                              '%.0f' % total if seq in seen else '-', fate))
+
+    latencies.sort()
+    print()
+    print('%d samples: %d delivered, %d overtaken on the host, %d lost' %
+          (sum(counts.values()), counts['delivered'], counts['overtaken'], counts['lost']))
+    print('Latency (us): min %.0f, median %.0f, p99 %.0f, max %.0f' %
+          (latencies[0], percentile(latencies, 50), percentile(latencies, 99), latencies[-1]))
+    if args.offset == 'auto':
+        print('(relative to the fastest sample, guest clock offset %d ns)' % offset)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,148 @@
+/*
+ * Guest side of the emulated Wacom tablets' latency probe.
+ *
+ * Reads the tablet's pen events from evdev inside a Linux guest using the
+ * input-wacom driver, recovers the sequence number that the tablet stamped
+ * into the low bits of each sample's coordinates, and prints the time the
+ * guest kernel received each one, plus any sequence numbers that went missing
+ * along the way. Join its output with the tablet's latency log using
+ * scripts/wacom-latency-join.py.
+ *
+ * Build and run inside the guest with e.g.:
+ *
+ *   cc -O2 -o wacom-latency-reader wacom-latency-reader.c
+ *   ./wacom-latency-reader /dev/input/event5 > guest.log
+ *
+ * The sequence bits must match WACOM_LATENCY_SEQ_BITS in dev-wacom-common.h.
+ *
+ * Copyright (c) 2020 Nicholas Sherlock <n.sherlock@gmail.com>
+ *
+ * This work is licensed under the MIT license, see the file headers of the
+ * tablet devices for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/input.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+// Kernels before 4.16 only have the timeval
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+#define SEQ_BITS 6
+#define SEQ_MASK ((1 << SEQ_BITS) - 1)
+#define SEQ_MODULO (1 << (SEQ_BITS * 2))
+
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct input_event ev;
+    int clock = CLOCK_REALTIME;
+    int fd, x = -1, y = -1, lastSeq = -1;
+    bool inProx = false, moved = false;
+    uint64_t received = 0, missing = 0;
+    char name[256] = "";
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s /dev/input/eventN\n", argv[0]);
+        return 2;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    // Timestamp events with the wall clock, so they can be compared with the host's
+    if (ioctl(fd, EVIOCSCLOCKID, &clock) < 0) {
+        fprintf(stderr, "Can't select the realtime clock: %s\n", strerror(errno));
+        return 1;
+    }
+
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+    fprintf(stderr, "Reading %s (%s), press Ctrl+C to stop\n", argv[1], name);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    printf("# sequence guest-clock-ns\n");
+
+    while (!stop) {
+        if (read(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Read failed: %s\n", strerror(errno));
+            break;
+        }
+
+        switch (ev.type) {
+            case EV_ABS:
+                // The input core drops values that didn't change, so keep the last of each
+                if (ev.code == ABS_X) {
+                    x = ev.value;
+                    moved = true;
+                } else if (ev.code == ABS_Y) {
+                    y = ev.value;
+                    moved = true;
+                }
+                break;
+
+            case EV_KEY:
+                if (ev.code == BTN_TOOL_PEN || ev.code == BTN_TOOL_RUBBER) {
+                    inProx = ev.value != 0;
+                }
+                break;
+
+            case EV_SYN:
+                if (ev.code == SYN_REPORT && moved && inProx && x >= 0 && y >= 0) {
+                    int seq = (x & SEQ_MASK) | ((y & SEQ_MASK) << SEQ_BITS);
+
+                    // Only the guest's first sight of each sample counts
+                    if (seq != lastSeq) {
+                        if (lastSeq >= 0) {
+                            int gap = (seq - lastSeq - 1 + SEQ_MODULO) % SEQ_MODULO;
+
+                            for (int i = 1; i <= gap; i++) {
+                                printf("missing %d\n", (lastSeq + i) % SEQ_MODULO);
+                            }
+                            missing += gap;
+                        }
+
+                        printf("%d %" PRIu64 "\n", seq,
+                               (uint64_t) ev.input_event_sec * 1000000000 + (uint64_t) ev.input_event_usec * 1000);
+                        received++;
+                        lastSeq = seq;
+                    }
+                }
+                moved = false;
+                break;
+        }
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "%" PRIu64 " samples received, %" PRIu64 " missing\n", received, missing);
+
+    close(fd);
+
+    return 0;
+}